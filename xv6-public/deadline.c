@@ -0,0 +1,210 @@
+// Deadline scheduling class.
+//
+// A deadline process gets a runtime budget in every period,
+// and its job must finish by a deadline relative to the start
+// of the period. Processes with a RUNNABLE thread and budget
+// left are kept sorted by absolute deadline, and the earliest
+// one runs first (EDF). A process which used up its budget is
+// throttled until its next period begins.
+// Times are in ticks of the global clock.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "list.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "scheduler.h"
+
+// Compare times of the global clock, which may wrap.
+#define BEFORE(a, b) ((int)((a) - (b)) < 0)
+
+extern struct ptable ptable;
+
+/* Function: dl_new_period
+ * ------------------------
+ * @group      Deadline
+ * @brief      Start a new period if the last one is over.
+ * @note       A process which slept across its period starts
+ *             a new one when it wakes, not at the old boundary.
+ * @param[in]  thmain: main thread of the process
+ */
+static void
+dl_new_period(struct proc *thmain)
+{
+  uint now = ticks;
+
+  if(BEFORE(now, thmain->dl_next))
+    return;
+  thmain->dl_abs = now + thmain->dl_deadline;
+  thmain->dl_next = now + thmain->dl_period;
+  thmain->dl_budget = thmain->dl_runtime;
+}
+
+/* Function: dl_insert
+ * ------------------------
+ * @group      Deadline
+ * @brief      Put a process on the EDF queue, or on the
+ *             throttled list if it has no budget left.
+ * @param[in]  rq: locked run queue
+ * @param[in]  thmain: main thread of the process
+ */
+static void
+dl_insert(struct rq *rq, struct proc *thmain)
+{
+  struct list_head *q = &rq->dl.ready;
+  struct list_head *itr;
+  struct proc *p;
+
+  if(thmain->dl_budget <= 0){
+    list_add_tail(&thmain->dl, &rq->dl.throttled);
+    return;
+  }
+  for(itr = q->next; itr != q; itr = itr->next){
+    p = list_entry(itr, struct proc, dl);
+    if(BEFORE(thmain->dl_abs, p->dl_abs))
+      break;
+  }
+  list_add_tail(&thmain->dl, itr);
+}
+
+/* Function: dl_preempts
+ * ------------------------
+ * @group      Deadline
+ * @brief      Should a deadline process preempt the owner CPU
+ *             of its run queue?
+ * @note       Only if the CPU runs a thread of another class,
+ *             or of a process with a later deadline. An idle
+ *             CPU is woken by kick_idle() anyway. The running
+ *             thread is only read as a hint.
+ * @param[in]  rq: locked run queue
+ * @param[in]  thmain: main thread of the ready process
+ * @return     If so 1 else 0
+ */
+static int
+dl_preempts(struct rq *rq, struct proc *thmain)
+{
+  struct proc *cur = cpus[rq - ptable.rq].proc;
+
+  if(cur == 0 || main_thread(cur) == thmain)
+    return 0;
+  cur = main_thread(cur);
+  return cur->type != DEADLINE || BEFORE(thmain->dl_abs, cur->dl_abs);
+}
+
+/* Function: dl_enqueue
+ * ------------------------
+ * @group      Deadline
+ * @brief      Queue a process with its first ready thread.
+ * @note       A deadline job preempts the owner CPU of the
+ *             run queue, which may run MLFQ or stride work
+ *             or a job with a later deadline.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: enqueued thread
+ */
+static void
+dl_enqueue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  if(thmain->nready != 1)
+    return;
+  dl_new_period(thmain);
+  dl_insert(rq, thmain);
+  if(thmain->dl_budget > 0 && dl_preempts(rq, thmain))
+    resched_rq(rq);
+}
+
+static void
+dl_dequeue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  if(thmain->nready == 0)
+    list_del(&thmain->dl);
+}
+
+/* Function: dl_pick_next
+ * ------------------------
+ * @group      Deadline
+ * @brief      Select the process with the earliest deadline
+ *             which has a RUNNABLE thread allowed on the cpu.
+ * @note       Throttled processes whose next period has begun
+ *             are replenished first.
+ * @param[in]  rq: locked run queue
+ * @param[in]  cpu: cpu id
+ * @return     Main thread of the selected process or 0
+ */
+static struct proc*
+dl_pick_next(struct rq *rq, int cpu)
+{
+  struct list_head *q, *itr;
+  struct proc *thmain;
+
+  q = &rq->dl.throttled;
+  itr = q->next;
+  while(itr != q){
+    thmain = list_entry(itr, struct proc, dl);
+    itr = itr->next;
+    dl_new_period(thmain);
+    if(thmain->dl_budget > 0){
+      list_del(&thmain->dl);
+      dl_insert(rq, thmain);
+    }
+  }
+
+  q = &rq->dl.ready;
+  for(itr = q->next; itr != q; itr = itr->next){
+    thmain = list_entry(itr, struct proc, dl);
+    if(ready_thread_on(thmain, cpu))
+      return thmain;
+  }
+  return 0;
+}
+
+/* Function: dl_yield
+ * ------------------------
+ * @group      Deadline
+ * @brief      Charge a timer tick to the budget.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: running thread
+ */
+static void
+dl_yield(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  if(--thmain->dl_budget > 0 || thmain->nready == 0)
+    return;
+  list_del(&thmain->dl);
+  dl_insert(rq, thmain);
+}
+
+static void
+dl_attach(struct rq *rq, struct proc *thmain)
+{
+  if(thmain->nready > 0){
+    dl_new_period(thmain);
+    dl_insert(rq, thmain);
+  }
+}
+
+static void
+dl_detach(struct rq *rq, struct proc *thmain)
+{
+  if(thmain->nready > 0)
+    list_del(&thmain->dl);
+}
+
+struct sched_class dl_class = {
+  .name      = "deadline",
+  .enqueue   = dl_enqueue,
+  .dequeue   = dl_dequeue,
+  .pick_next = dl_pick_next,
+  .yield     = dl_yield,
+  .attach    = dl_attach,
+  .detach    = dl_detach,
+};
@@ -1,14 +1,19 @@
 struct buf;
 struct context;
 struct file;
+struct image;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct rq;
 struct rtcdate;
+struct sched_class;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct trace_event;
 
 // bio.c
 void            binit(void);
@@ -24,6 +29,8 @@ void            panic(char*) __attribute__((noreturn));
 
 // exec.c
 int             exec(char*, char**);
+int             loadimage(char*, char**, struct image*);
+void            setprogname(struct proc*, char*);
 
 // file.c
 struct file*    filealloc(void);
@@ -56,6 +63,7 @@ int             writei(struct inode*, char*, uint, uint);
 // futex.c
 int             futex_wait(thread_t* addr, thread_t tid);
 int             futex_wake(thread_t* addr);
+int             futex_handoff(thread_t* addr);
 
 // ide.c
 void            ideinit(void);
@@ -70,6 +78,10 @@ void            ioapicinit(void);
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+void            kref(char*);
+char*           kalloclarge(void);
+void            kfreelarge(char*);
+int             krefs(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -82,7 +94,9 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(uchar, int);
 void            lapicstartap(uchar, uint);
+void            lapictimer(int);
 void            microdelay(int);
 
 // log.c
@@ -91,6 +105,9 @@ void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
 
+// mlfq.c
+int             getlev(struct proc*);
+
 // mp.c
 extern int      ismp;
 void            mpinit(void);
@@ -100,6 +117,7 @@ void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -109,8 +127,10 @@ int             pipewrite(struct pipe*, char*, int);
 // proc.c
 int             cpuid(void);
 void            exit(void);
-int             fork(void);
+int             fork(int);
+int             spawn(char*, char**, int*);
 struct proc*    allocproc(void);
+struct proc*    find_proc(int);
 int             growproc(int);
 int             kill(int);
 struct cpu*     mycpu(void);
@@ -124,10 +144,25 @@ void            userinit(void);
 int             wait(void);
 void            wakeup1(void*);
 void            wakeup(void*);
+void            wakeup_handoff(void*);
 void            yield(void);
+void            preempt(void);
+int             yield_to(struct proc*);
 int             set_cpu_share(int);
+int             setsched(int, int);
+int             setdeadline(int, int, int);
+int             setgang(int);
+int             setaffinity(int, uint);
+int             getaffinity(int);
+struct sched_class* sched_class(struct proc*);
 void            enqueue_thread(struct proc*);
 void            dequeue_thread(struct proc*);
+struct rq*      proc_rq(struct proc*);
+struct rq*      rq_lock_proc(struct proc*);
+void            rq_barrier(struct proc*);
+void            kick_idle(struct rq*, struct proc*);
+void            update_tick(void);
+void            resched_rq(struct rq*);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -141,6 +176,11 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -171,19 +211,39 @@ struct proc*    threads_apply0(struct proc*, callback0);
 struct proc*    threads_apply1(struct proc*, callback1, void*);
 struct proc*    main_thread(struct proc*);
 struct proc*    ready_thread(struct proc*);
-struct proc*    sleeping_thread(struct proc*);
+struct proc*    ready_thread_on(struct proc*, int);
+void            share_enqueue(struct proc*);
+void            share_dequeue(struct proc*);
+void            share_charge(struct proc*);
+struct proc*    running_thread(struct proc*);
 struct proc*    ready_or_running_thread(struct proc*);
+void            hash_thread(struct proc*);
+void            unhash_thread(struct proc*);
+struct proc*    lookup_thread(int, thread_t);
 struct proc*    get_thread(struct proc*, thread_t);
+struct proc*    find_thread(thread_t);
 int             thread_size(struct proc*);
 void            terminate_proc(struct proc*);
 int             monopolize_proc(struct proc*);
 int             thread_create(thread_t*, void*(*)(void*), void*);
 void            thread_exit(void*);
 int             thread_join(thread_t, void **);
+int             set_thread_share(thread_t, int, int);
+int             set_group_share(int, int);
 
 // timer.c
 void            timerinit(void);
 
+// trace.c
+void            traceinit(void);
+void            trace(int, struct proc*);
+int             trace_drain(struct trace_event*, int);
+
+// tlb.c
+void            tlbinit(void);
+void            tlbpoll(void);
+void            tlbflush(pde_t*, uint*, int);
+
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
@@ -205,10 +265,10 @@ int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(struct proc *p);
-void            invalidate_tlb(struct proc *p);
+pde_t*          copyuvm(struct proc *p, int);
+int             pgfault(uint, uint);
+extern struct spinlock vmlock;
 void            switchuvm(struct proc*);
-void            vswitchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
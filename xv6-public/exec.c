@@ -8,19 +8,19 @@
 #include "x86.h"
 #include "elf.h"
 
+// Load the program at path into a new page table, with
+// argv pushed on the user stack at USERTOP - USTACKSIZE.
+// It doesn't touch the current process, so spawn() uses
+// it to build a process without copying the caller.
 int
-exec(char *path, char **argv)
+loadimage(char *path, char **argv, struct image *img)
 {
-  char *s, *last;
   int i, off;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
-  struct proc *curproc = myproc();
-
-  monopolize_proc(curproc);
+  pde_t *pgdir;
 
   begin_op();
 
@@ -67,7 +67,6 @@ exec(char *path, char **argv)
   // Make the first inaccessible.  Use the second as the user stack.
   sz = PGROUNDUP(sz);
 
-  curproc->ustack = USERTOP - USTACKSIZE;
   if(allocustack(pgdir, USERTOP - USTACKSIZE) == 0)
     goto bad;
   sp = USERTOP;
@@ -91,20 +90,11 @@ exec(char *path, char **argv)
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
     goto bad;
 
-  // Save program name for debugging.
-  for(last=s=path; *s; s++)
-    if(*s == '/')
-      last = s+1;
-  safestrcpy(curproc->name, last, sizeof(curproc->name));
-
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
-  curproc->tf->esp = sp;
-  switchuvm(curproc);
-  freevm(oldpgdir);
+  img->pgdir = pgdir;
+  img->sz = sz;
+  img->ustack = USERTOP - USTACKSIZE;
+  img->sp = sp;
+  img->entry = elf.entry;
   return 0;
 
  bad:
@@ -116,3 +106,41 @@ exec(char *path, char **argv)
   }
   return -1;
 }
+
+// Save program name for debugging.
+void
+setprogname(struct proc *p, char *path)
+{
+  char *s, *last;
+
+  for(last=s=path; *s; s++)
+    if(*s == '/')
+      last = s+1;
+  safestrcpy(p->name, last, sizeof(p->name));
+}
+
+int
+exec(char *path, char **argv)
+{
+  struct image img;
+  pde_t *oldpgdir;
+  struct proc *curproc = myproc();
+
+  monopolize_proc(curproc);
+
+  if(loadimage(path, argv, &img) < 0)
+    return -1;
+
+  setprogname(curproc, path);
+
+  // Commit to the user image.
+  oldpgdir = curproc->pgdir;
+  curproc->pgdir = img.pgdir;
+  curproc->sz = img.sz;
+  curproc->ustack = img.ustack;
+  curproc->tf->eip = img.entry;  // main
+  curproc->tf->esp = img.sp;
+  switchuvm(curproc);
+  freevm(oldpgdir);
+  return 0;
+}
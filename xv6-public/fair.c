@@ -0,0 +1,318 @@
+// Weighted fair scheduling class.
+//
+// Every process has a virtual runtime, which advances by its
+// real runtime (in tsc cycles) scaled by FAIR_WEIGHT / weight.
+// Processes with a RUNNABLE thread are kept in an AVL tree
+// keyed on the virtual runtime, and the leftmost one runs next.
+// While a process is detached from a run queue, its virtual
+// runtime is kept relative to min_vruntime of the queue.
+//
+// The fair class and MLFQ share one client of stride
+// scheduling. Within it, MLFQ competes as one more process
+// of FAIR_WEIGHT, so neither class starves the other.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "list.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "scheduler.h"
+
+// [AVL tree]
+static int
+fair_less(struct proc *a, struct proc *b)
+{
+  if(a->vruntime != b->vruntime)
+    return a->vruntime < b->vruntime;
+  return a < b;
+}
+
+static int
+height(struct proc *n)
+{
+  return n ? n->fheight : 0;
+}
+
+static void
+update(struct proc *n)
+{
+  int hl = height(n->fleft);
+  int hr = height(n->fright);
+
+  n->fheight = (hl > hr ? hl : hr) + 1;
+}
+
+static struct proc*
+rotate_right(struct proc *n)
+{
+  struct proc *l = n->fleft;
+
+  n->fleft = l->fright;
+  l->fright = n;
+  update(n);
+  update(l);
+  return l;
+}
+
+static struct proc*
+rotate_left(struct proc *n)
+{
+  struct proc *r = n->fright;
+
+  n->fright = r->fleft;
+  r->fleft = n;
+  update(n);
+  update(r);
+  return r;
+}
+
+static struct proc*
+balance(struct proc *n)
+{
+  int bf;
+
+  update(n);
+  bf = height(n->fleft) - height(n->fright);
+  if(bf > 1){
+    if(height(n->fleft->fleft) < height(n->fleft->fright))
+      n->fleft = rotate_left(n->fleft);
+    return rotate_right(n);
+  }
+  if(bf < -1){
+    if(height(n->fright->fright) < height(n->fright->fleft))
+      n->fright = rotate_right(n->fright);
+    return rotate_left(n);
+  }
+  return n;
+}
+
+static struct proc*
+avl_insert(struct proc *root, struct proc *n)
+{
+  if(root == 0){
+    n->fleft = n->fright = 0;
+    n->fheight = 1;
+    return n;
+  }
+  if(fair_less(n, root))
+    root->fleft = avl_insert(root->fleft, n);
+  else
+    root->fright = avl_insert(root->fright, n);
+  return balance(root);
+}
+
+static struct proc*
+avl_removemin(struct proc *root, struct proc **min)
+{
+  if(root->fleft == 0){
+    *min = root;
+    return root->fright;
+  }
+  root->fleft = avl_removemin(root->fleft, min);
+  return balance(root);
+}
+
+static struct proc*
+avl_remove(struct proc *root, struct proc *n)
+{
+  struct proc *min, *right;
+
+  if(root == n){
+    if(n->fright == 0)
+      return n->fleft;
+    right = avl_removemin(n->fright, &min);
+    min->fright = right;
+    min->fleft = n->fleft;
+    return balance(min);
+  }
+  if(fair_less(n, root))
+    root->fleft = avl_remove(root->fleft, n);
+  else
+    root->fright = avl_remove(root->fright, n);
+  return balance(root);
+}
+
+//////////
+
+static void
+fair_insert(struct rq *rq, struct proc *thmain)
+{
+  rq->fair.root = avl_insert(rq->fair.root, thmain);
+}
+
+static void
+fair_remove(struct rq *rq, struct proc *thmain)
+{
+  rq->fair.root = avl_remove(rq->fair.root, thmain);
+  thmain->fheight = 0;
+}
+
+/* Function: fair_enqueue
+ * ------------------------
+ * @group      Fair
+ * @brief      Put a process in the tree with its first ready thread.
+ * @note       A process can't bank the time it slept,
+ *             so its virtual runtime catches up with min_vruntime.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: enqueued thread
+ */
+static void
+fair_enqueue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  if(thmain->nready == 1){
+    if(thmain->vruntime < rq->fair.min_vruntime)
+      thmain->vruntime = rq->fair.min_vruntime;
+    fair_insert(rq, thmain);
+  }
+}
+
+static void
+fair_dequeue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  if(thmain->nready == 0)
+    fair_remove(rq, thmain);
+}
+
+// The leftmost node whose process has a RUNNABLE thread
+// allowed on the cpu, in the order of vruntime.
+static struct proc*
+leftmost_on(struct proc *n, int cpu)
+{
+  struct proc *p;
+
+  if(n == 0)
+    return 0;
+  if((p = leftmost_on(n->fleft, cpu)) != 0)
+    return p;
+  if(ready_thread_on(n, cpu))
+    return n;
+  return leftmost_on(n->fright, cpu);
+}
+
+static struct proc*
+fair_pick_next(struct rq *rq, int cpu)
+{
+  struct proc *n = rq->fair.root;
+
+  if(n == 0)
+    return 0;
+  while(n->fleft)
+    n = n->fleft;
+  if(rq->fair.min_vruntime < n->vruntime)
+    rq->fair.min_vruntime = n->vruntime;
+  return ready_thread_on(n, cpu) ? n : leftmost_on(rq->fair.root, cpu);
+}
+
+/* Function: fair_tick
+ * ------------------------
+ * @group      Fair
+ * @brief      Charge the weighted runtime of a dispatched thread
+ *             to its process and reposition it.
+ * @note       The fair class is charged as a client of stride
+ *             scheduling, like MLFQ.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: thread which was dispatched
+ */
+static void
+fair_tick(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+  uint64 delta = rdtsc() - thmain->exec_start;
+  int queued = thmain->fheight != 0;
+
+  if(delta > 0xffffffff)
+    delta = 0xffffffff;
+  if(queued)
+    fair_remove(rq, thmain);
+  thmain->vruntime += delta * ((FAIR_WEIGHT << 16) / thmain->weight) >> 16;
+  if(queued)
+    fair_insert(rq, thmain);
+  rq->pass += STRD(rq->tickets);
+}
+
+static void
+fair_yield(struct rq *rq, struct proc *th)
+{
+}
+
+/* Function: fair_first
+ * ------------------------
+ * @group      Fair
+ * @brief      Should the fair class be asked before MLFQ?
+ * @note       Whichever of them is behind in virtual runtime
+ *             goes first. MLFQ can't bank the time it had
+ *             nothing to run, like a waking fair process.
+ * @param[in]  rq: locked run queue
+ * @return     If so 1 else 0
+ */
+int
+fair_first(struct rq *rq)
+{
+  struct proc *n = rq->fair.root;
+
+  if(rq->fair.mlfq_vruntime < rq->fair.min_vruntime)
+    rq->fair.mlfq_vruntime = rq->fair.min_vruntime;
+  if(n == 0)
+    return 0;
+  while(n->fleft)
+    n = n->fleft;
+  return n->vruntime < rq->fair.mlfq_vruntime;
+}
+
+/* Function: fair_charge_mlfq
+ * ------------------------
+ * @group      Fair
+ * @brief      Charge the runtime of a dispatched MLFQ thread
+ *             to the virtual runtime of MLFQ.
+ * @note       While no fair process is queued, min_vruntime
+ *             follows MLFQ, so a fair process which wakes later
+ *             can't bank the time MLFQ ran alone either.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: thread which was dispatched
+ */
+void
+fair_charge_mlfq(struct rq *rq, struct proc *th)
+{
+  uint64 delta = rdtsc() - main_thread(th)->exec_start;
+
+  if(delta > 0xffffffff)
+    delta = 0xffffffff;
+  rq->fair.mlfq_vruntime += delta;
+  if(rq->fair.root == 0 && rq->fair.min_vruntime < rq->fair.mlfq_vruntime)
+    rq->fair.min_vruntime = rq->fair.mlfq_vruntime;
+}
+
+static void
+fair_attach(struct rq *rq, struct proc *thmain)
+{
+  thmain->vruntime += rq->fair.min_vruntime;
+  if(thmain->nready > 0)
+    fair_insert(rq, thmain);
+}
+
+static void
+fair_detach(struct rq *rq, struct proc *thmain)
+{
+  if(thmain->fheight != 0)
+    fair_remove(rq, thmain);
+  thmain->vruntime -= rq->fair.min_vruntime;
+}
+
+struct sched_class fair_class = {
+  .name      = "fair",
+  .enqueue   = fair_enqueue,
+  .dequeue   = fair_dequeue,
+  .pick_next = fair_pick_next,
+  .tick      = fair_tick,
+  .yield     = fair_yield,
+  .attach    = fair_attach,
+  .detach    = fair_detach,
+};
@@ -36,7 +36,7 @@ futex_wake(thread_t* addr)
   struct proc* th;
 
   acquire(&futex);
-  th = get_thread(myproc(), *addr);
+  th = find_thread(*addr);
   if(th != 0) {
     wakeup(th);
   }
@@ -47,3 +47,28 @@ futex_wake(thread_t* addr)
   release(&futex);
   return 0;
 }
+
+// Wake the thread like futex_wake and switch to it at once,
+// so that a lock is handed off in one context switch.
+// If the switch fails, th was taken by another CPU, which
+// the wakeup already woke if it was idle.
+int
+futex_handoff(thread_t* addr)
+{
+  struct proc* th;
+  thread_t tid;
+
+  acquire(&futex);
+  tid = *addr;
+  th = find_thread(tid);
+  if(th == 0){
+    release(&futex);
+    return -1;
+  }
+  wakeup_handoff(th);
+  release(&futex);
+  // th may have exited meanwhile, so look it up again.
+  if((th = find_thread(tid)) != 0)
+    yield_to(th);
+  return 0;
+}
@@ -1,6 +1,14 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Every cpu caches free pages of its own, and takes the
+// lock of the global free list only to refill or drain
+// its cache by KBATCH pages at a time.
+//
+// The global free list is kept per 4 MB region with a count,
+// so a region whose pages are all free is found without a
+// scan and taken whole for a large page (see kalloclarge).
 
 #include "types.h"
 #include "defs.h"
@@ -8,6 +16,12 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "debug.h"
+
+#define KBATCH  32         // pages moved between a cache and the free list
+#define KCACHE  (2*KBATCH) // most pages a cache holds
+#define NREGION (PHYSTOP / LPGSIZE)
+#define REGION(v) (V2P(v) / LPGSIZE)
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,12 +31,25 @@ struct run {
   struct run *next;
 };
 
+// Pages shared copy-on-write have more than one reference.
+// A page goes back to the free list when the last one drops.
+// References are changed atomically, without the lock.
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run *freelist[NREGION];    // free pages of each region
+  ushort nfree[NREGION];            // # of pages in freelist
+  int nfull;                        // # of regions entirely free
+  ushort ref[PHYSTOP >> PTXSHIFT];  // references of each page
 } kmem;
 
+// Free pages cached by a cpu. They have no references, like
+// the pages of the free list. Used with interrupts disabled.
+struct kcache {
+  struct run *list;
+  int n;
+} kcache[NCPU];
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -48,8 +75,103 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    kmem.ref[V2P(p) >> PTXSHIFT] = 1;
     kfree(p);
+  }
+}
+
+// Put a free page on the list of its region.
+static void
+kpush(struct run *r)
+{
+  int i = REGION(r);
+
+  r->next = kmem.freelist[i];
+  kmem.freelist[i] = r;
+  if(++kmem.nfree[i] == NPTENTRIES)
+    kmem.nfull++;
+}
+
+// Take a free page from a region which has one.
+static struct run*
+kpop(int i)
+{
+  struct run *r = kmem.freelist[i];
+
+  if(kmem.nfree[i]-- == NPTENTRIES)
+    kmem.nfull--;
+  kmem.freelist[i] = r->next;
+  return r;
+}
+
+/* Function: kregion
+ * ------------------------
+ * @group      VM
+ * @brief      Choose the region to take small pages from.
+ * @note       The one with the fewest free pages is used up
+ *             first, so entirely free regions are kept for
+ *             large pages as long as possible.
+ * @return     Region, or -1 if no page is free
+ */
+static int
+kregion(void)
+{
+  int i, best = -1;
+
+  for(i = 0; i < NREGION; i++)
+    if(kmem.nfree[i] > 0 &&
+       (best < 0 || kmem.nfree[i] < kmem.nfree[best]))
+      best = i;
+  return best;
+}
+
+/* Function: krefill
+ * ------------------------
+ * @group      VM
+ * @brief      Move up to KBATCH pages from the free list
+ *             to the cache of a cpu.
+ * @param[in]  c: empty cache of the current cpu
+ */
+static void
+krefill(struct kcache *c)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  while(c->n < KBATCH && (i = kregion()) >= 0){
+    while(c->n < KBATCH && kmem.nfree[i] > 0){
+      r = kpop(i);
+      r->next = c->list;
+      c->list = r;
+      c->n++;
+    }
+  }
+  release(&kmem.lock);
+}
+
+/* Function: kdrain
+ * ------------------------
+ * @group      VM
+ * @brief      Move KBATCH pages from the cache of a cpu
+ *             to the free list.
+ * @param[in]  c: full cache of the current cpu
+ */
+static void
+kdrain(struct kcache *c)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < KBATCH; i++){
+    r = c->list;
+    c->list = r->next;
+    kpush(r);
+  }
+  c->n -= KBATCH;
+  release(&kmem.lock);
 }
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
@@ -60,20 +182,33 @@ void
 kfree(char *v)
 {
   struct run *r;
+  struct kcache *c;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  // Drop a reference.
+  if(__sync_sub_and_fetch(&kmem.ref[V2P(v) >> PTXSHIFT], 1) != 0)
+    return;
+
+#if LOGGING && LOG_LEVEL <= DEBUG_LEVEL_DEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  // Before kinit2, only this cpu runs and the caches aren't used.
+  if(!kmem.use_lock){
+    kpush(r);
+    return;
+  }
+  pushcli();
+  c = &kcache[cpuid()];
+  r->next = c->list;
+  c->list = r;
+  if(++c->n > KCACHE)
+    kdrain(c);
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +218,87 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kcache *c;
+  int i;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    if((i = kregion()) < 0)
+      return 0;
+    r = kpop(i);
+    kmem.ref[V2P(r) >> PTXSHIFT] = 1;
+    return (char*)r;
+  }
+  pushcli();
+  c = &kcache[cpuid()];
+  if(c->n == 0)
+    krefill(c);
+  if((r = c->list) != 0){
+    c->list = r->next;
+    c->n--;
+    kmem.ref[V2P(r) >> PTXSHIFT] = 1;
+  }
+  popcli();
   return (char*)r;
 }
 
+// Allocate LPGSIZE bytes of physical memory aligned to
+// LPGSIZE, for a large page mapping. It is made of normal
+// pages with their own references, so the mapping can be
+// split and the pages freed one at a time.
+// Only a region whose pages are all on the free list is
+// taken, and nfull tells at once if there is none.
+// Returns 0 if no region is entirely free.
+char*
+kalloclarge(void)
+{
+  struct run *r;
+  int i;
+
+  if(!kmem.use_lock || kmem.nfull == 0)
+    return 0;
+  acquire(&kmem.lock);
+  for(i = 0; i < NREGION; i++)
+    if(kmem.nfree[i] == NPTENTRIES)
+      break;
+  if(i == NREGION){
+    release(&kmem.lock);
+    return 0;
+  }
+  for(r = kmem.freelist[i]; r != 0; r = r->next)
+    kmem.ref[V2P(r) >> PTXSHIFT] = 1;
+  kmem.freelist[i] = 0;
+  kmem.nfree[i] = 0;
+  kmem.nfull--;
+  release(&kmem.lock);
+  return (char*)P2V(i * LPGSIZE);
+}
+
+// Free the pages of a large page mapping. The pages
+// bypass the cpu cache, so the region can be whole again.
+void
+kfreelarge(char *v)
+{
+  char *last = v + LPGSIZE;
+
+  acquire(&kmem.lock);
+  for(; v < last; v += PGSIZE)
+    if(__sync_sub_and_fetch(&kmem.ref[V2P(v) >> PTXSHIFT], 1) == 0)
+      kpush((struct run*)v);
+  release(&kmem.lock);
+}
+
+// Add a reference to a page which is shared
+// copy-on-write.
+void
+kref(char *v)
+{
+  __sync_fetch_and_add(&kmem.ref[V2P(v) >> PTXSHIFT], 1);
+}
+
+// Get the number of references to a page.
+int
+krefs(char *v)
+{
+  return kmem.ref[V2P(v) >> PTXSHIFT];
+}
+
@@ -43,6 +43,8 @@
 
 volatile uint *lapic;  // Initialized in mp.c
 
+#define TICKCOUNT 10000000   // bus cycles of a timer tick
+
 //PAGEBREAK!
 static void
 lapicw(int index, int value)
@@ -66,7 +68,7 @@ lapicinit(void)
   // TICR would be calibrated using an external time source.
   lapicw(TDCR, X1);
   lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TICR, TICKCOUNT);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -120,6 +122,30 @@ microdelay(int us)
 {
 }
 
+// Send a fixed interrupt with vector to the CPU of apicid.
+// Interrupts must be disabled.
+void
+lapicipi(uchar apicid, int vector)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// Switch the timer to one-shot mode, and arm it for
+// one tick if on is set or stop it otherwise.
+// Only CPU 0 keeps the periodic timer for the global ticks,
+// and the others arm a tick only when they need it.
+void
+lapictimer(int on)
+{
+  if(!lapic)
+    return;
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, on ? TICKCOUNT : 0);
+}
+
 #define CMOS_PORT    0x70
 #define CMOS_RETURN  0x71
 
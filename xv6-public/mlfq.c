@@ -0,0 +1,262 @@
+// MLFQ scheduling class.
+//
+// Each level queues processes, not threads. A process is
+// in the queue of its level if and only if it has a
+// RUNNABLE thread, and the bitmap tells the non-empty
+// levels, so the next process is found in O(1).
+//
+// A priority boost only merges the queues and starts a new
+// epoch of the run queue. Every process resets its own level
+// and ticks when it is next touched in a later epoch, so
+// privlevel must be read through mlfq_sync() or getlev().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "list.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "scheduler.h"
+
+/* Function: mlfq_sync
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Apply the priority boosts the process missed.
+ * @param[in]  rq: locked run queue of the process
+ * @param[in]  thmain: main thread of the process
+ */
+static void
+mlfq_sync(struct rq *rq, struct proc *thmain)
+{
+  if(thmain->epoch != rq->mlfq.epoch){
+    thmain->epoch = rq->mlfq.epoch;
+    thmain->privlevel = 0;
+    thmain->ticks = 0;
+  }
+}
+
+/* Function: mlfq_add
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Put a process on the queue of its level.
+ * @param[in]  thmain: main thread of the process
+ * @param[in]  head: if 1, put at the head to keep the time quantum
+ *                   else (0), put at the tail
+ */
+static void
+mlfq_add(struct proc *thmain, int head)
+{
+  struct mlfq *mlfq = &thmain->rq->mlfq;
+  int level = thmain->privlevel;
+
+  if(head)
+    list_add(&thmain->mlfq, &mlfq->queue[level]);
+  else
+    list_add_tail(&thmain->mlfq, &mlfq->queue[level]);
+  mlfq->bitmap |= 1 << level;
+}
+
+/* Function: mlfq_del
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Take a process off the queue of its level.
+ * @param[in]  thmain: main thread of the process
+ */
+static void
+mlfq_del(struct proc *thmain)
+{
+  struct mlfq *mlfq = &thmain->rq->mlfq;
+  int level = thmain->privlevel;
+
+  list_del(&thmain->mlfq);
+  if(list_empty(&mlfq->queue[level]))
+    mlfq->bitmap &= ~(1 << level);
+}
+
+/* Function: concatqueue
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Concatenate src queue to dst queue of MLFQ.
+ * @note       It is called when the priority boost occurs.
+ * @param[in]  rq: run queue
+ * @param[in]  src: the level of source queue
+ * @param[in]  dst: the level of destination queue
+ * @example    src: 1, dst: 0
+ *             [queue0]     [queue1]     [queue2]
+ *             ->[queue0~queue1]  []     [queue2]
+ */
+static void
+concatqueue(struct rq *rq, int src, int dst)
+{
+  struct list_head *srcq = &rq->mlfq.queue[src];
+  struct list_head *dstq = &rq->mlfq.queue[dst];
+
+  list_bulk_move_tail(srcq, dstq);
+  if(!list_empty(dstq))
+    rq->mlfq.bitmap |= 1 << dst;
+  rq->mlfq.bitmap &= ~(1 << src);
+}
+
+/* Function: priority_boost
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Move every process of the run queue to the top level.
+ * @note       Queued processes are moved in O(levels), and the
+ *             new epoch resets the level and ticks of every
+ *             process lazily (see mlfq_sync).
+ * @param[in]  rq: locked run queue
+ */
+static void
+priority_boost(struct rq *rq)
+{
+  int l, baselevel = QSIZE-1;
+
+  for(l = 1; l <= baselevel; l++)
+    concatqueue(rq, l, 0);
+  rq->mlfq.epoch++;
+  rq->mlfq.ticks = 0;
+}
+
+/* Function: getlev
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Get the level of an MLFQ process.
+ * @note       It doesn't need the run queue lock, since a stale
+ *             level is reported as 0 without being reset.
+ * @param[in]  thmain: main thread of the process
+ * @return     Level of the process
+ */
+int
+getlev(struct proc *thmain)
+{
+  struct rq *rq = thmain->rq;
+
+  if(rq == 0 || thmain->epoch != rq->mlfq.epoch)
+    return 0;
+  return thmain->privlevel;
+}
+
+static void
+mlfq_enqueue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  mlfq_sync(rq, thmain);
+  if(thmain->nready == 1)
+    mlfq_add(thmain, 0);
+}
+
+static void
+mlfq_dequeue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  mlfq_sync(rq, thmain);
+  if(thmain->nready == 0)
+    mlfq_del(thmain);
+}
+
+/* Function: mlfq_pick_next
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Select the first process of the highest level
+ *             which has a RUNNABLE thread allowed on the cpu.
+ * @note       The head of the first non-empty level is almost
+ *             always allowed, so it stays O(1) in practice.
+ * @param[in]  rq: locked run queue
+ * @param[in]  cpu: cpu id
+ * @return     Main thread of the selected process or 0
+ */
+static struct proc*
+mlfq_pick_next(struct rq *rq, int cpu)
+{
+  struct list_head *q, *itr;
+  struct proc *thmain;
+  uint bitmap;
+  int l;
+
+  if(rq->mlfq.ticks >= BOOSTINTERVAL)
+    priority_boost(rq);
+  for(bitmap = rq->mlfq.bitmap; bitmap != 0; bitmap &= ~(1 << l)){
+    l = bsf(bitmap);
+    q = &rq->mlfq.queue[l];
+    for(itr = q->next; itr != q; itr = itr->next){
+      thmain = list_entry(itr, struct proc, mlfq);
+      if(ready_thread_on(thmain, cpu))
+        return thmain;
+    }
+  }
+  return 0;
+}
+
+/* Function: mlfq_tick
+ * -------------------------
+ * @group      MLFQ
+ * @brief      Demote or requeue the process after it ran.
+ * @note       MLFQ is charged as a client of stride scheduling,
+ *             and against the fair class within it.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: thread which was dispatched
+ */
+static void
+mlfq_tick(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+  int l, baselevel = QSIZE-1;
+  int queued = thmain->nready > 0;
+
+  mlfq_sync(rq, thmain);
+  l = thmain->privlevel;
+  if(queued)
+    mlfq_del(thmain);
+  if(l < baselevel && thmain->ticks >= TA(l)){
+    thmain->privlevel = l+1;
+    thmain->ticks = 0;
+    if(queued)
+      mlfq_add(thmain, 0);
+  } else if(queued){
+    // Keep the head until the time quantum expires
+    mlfq_add(thmain, thmain->ticks % TQ(l) != 0);
+  }
+  fair_charge_mlfq(rq, th);
+  rq->pass += STRD(rq->tickets);
+}
+
+static void
+mlfq_yield(struct rq *rq, struct proc *th)
+{
+  mlfq_sync(rq, main_thread(th));
+  rq->mlfq.ticks++;
+}
+
+// The level was synced on detach and is carried over
+// to the epoch of the new run queue.
+static void
+mlfq_attach(struct rq *rq, struct proc *thmain)
+{
+  thmain->epoch = rq->mlfq.epoch;
+  if(thmain->nready > 0)
+    mlfq_add(thmain, 0);
+}
+
+static void
+mlfq_detach(struct rq *rq, struct proc *thmain)
+{
+  mlfq_sync(rq, thmain);
+  if(thmain->nready > 0)
+    mlfq_del(thmain);
+}
+
+struct sched_class mlfq_class = {
+  .name      = "mlfq",
+  .enqueue   = mlfq_enqueue,
+  .dequeue   = mlfq_dequeue,
+  .pick_next = mlfq_pick_next,
+  .tick      = mlfq_tick,
+  .yield     = mlfq_yield,
+  .attach    = mlfq_attach,
+  .detach    = mlfq_detach,
+};
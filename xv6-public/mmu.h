@@ -90,11 +90,21 @@ struct segdesc {
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// A large page (PTE_PS in a page directory entry) maps
+// what a whole page table would.
+#define LPGSIZE          (PGSIZE*NPTENTRIES)
+#define LPGROUNDUP(sz)  (((sz)+LPGSIZE-1) & ~(LPGSIZE-1))
+#define LPGROUNDDOWN(a) (((a)) & ~(LPGSIZE-1))
+
 // Page table/directory entry flags.
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
 #define PTE_PS          0x080   // Page Size
+#define PTE_COW         0x200   // Copy-on-write (available to software)
+
+// Page fault error code
+#define FEC_WR          0x002   // Caused by a write
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -3,7 +3,6 @@
 #define USTACKSIZE   4096    // size of per-process user stack
 #define NCPU            8    // maximum number of CPUs
 #define NOFILE         16    // open files per process
-#define NFILE         100    // open files per system
 #define NINODE         50    // maximum number of active i-nodes
 #define NDEV           10    // maximum major device number
 #define ROOTDEV         1    // device number of file system root disk
@@ -14,4 +13,6 @@
 #define FSSIZE      40000    // size of file system in blocks
 #define QSIZE           3    // total levels size of mlfq
 #define BOOSTINTERVAL 200    // ticks interval of priority boost
-#define RESERVE        20    // required tickets reserve of mlfq 
+#define RESERVE        20    // required tickets reserve of mlfq
+#define NTGROUP         4    // thread groups per process
+#define NTLBBATCH      16    // pages flushed one by one by a shootdown
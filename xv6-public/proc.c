@@ -4,6 +4,8 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
+#include "trace.h"
 #include "list.h"
 #include "proc.h"
 #include "spinlock.h"
@@ -19,71 +21,107 @@ int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void pushheap(struct proc*);
 static void enqueue_proc(struct proc*);
-static void dequeue_proc(struct proc*);
-static int getminpass(void);
+static void kick_tickless(int);
+
+// Scheduling classes indexed by enum schedtype
+static struct sched_class *sched_classes[] = {
+[MLFQ]    &mlfq_class,
+[STRIDE]  &stride_class,
+[FAIR]    &fair_class,
+[DEADLINE] &dl_class,
+};
+
+// Scheduling classes in the order pick_next() asks them.
+// Deadline jobs go before everything else, and stride
+// decides by itself whether it is ahead of the others.
+// MLFQ and fair take turns by virtual runtime (see fair_first),
+// so there is an order for either of them first.
+static struct sched_class *pick_order[2][4] = {
+  { &dl_class, &stride_class, &mlfq_class, &fair_class },
+  { &dl_class, &stride_class, &fair_class, &mlfq_class },
+};
 
 // [Thread routines]
 static struct proc*
-__routine_set_stride(struct proc *th)
+__routine_set_type(struct proc *th, void *type)
 {
-  th->type = STRIDE;
+  th->type = (enum schedtype)type;
   return 0;
 }
 
 static struct proc*
-__routine_is_pinned(struct proc *th, void *pin)
+__routine_set_affinity(struct proc *th, void *cpumask)
 {
-  return &th->mlfq == (struct list_head*)pin ? th : 0;
+  th->cpumask = (uint)cpumask;
+  return 0;
 }
 
 static struct proc*
-__routine_enqueue_remain(struct proc *th, void *p)
+__routine_get_affinity(struct proc *th, void *cpumask)
 {
-  struct proc *pivot = (struct proc *)p;
-  if(th != pivot && (th->state == RUNNABLE || th->state == RUNNING))
-    list_add_after(&th->mlfq, &pivot->mlfq);
+  *(uint*)cpumask |= th->cpumask;
   return 0;
 }
 
 static struct proc*
-__routine_dequeue_proc(struct proc *th)
+__routine_kick_running(struct proc *th)
 {
-  if(th->state == RUNNABLE || th->state == RUNNING)
-    list_del(&th->mlfq);
+  if(th->state == RUNNING)
+    kick_tickless(th->last_cpu);
   return 0;
 }
 
 static struct proc*
-ready_proc(struct proc *p)
+__routine_enqueue_ready(struct proc *th)
 {
-  struct proc *np;
-  struct list_head *q;
-  struct list_head *start, *itr;
-  int level = main_thread(p)->privlevel;
-
-  if(p->state != RUNNABLE && p->state != RUNNING)
-    panic("ready_proc");
-
-  q = &ptable.mlfq.queue[level];
-  start = &p->mlfq;
-  for(itr = start->next; itr != start; itr = itr->next){
-    if(!list_is_head(itr, q)){
-      np = list_entry(itr, struct proc, mlfq);
-      if(np->pid != p->pid && np->state == RUNNABLE)
-        return np;
-    }
-  }
+  if(th->state == RUNNABLE)
+    enqueue_thread(th);
   return 0;
 }
 
+/* Function: sched_class
+ * ------------------------
+ * @group      Scheduler
+ * @brief      Get the scheduling class of a thread.
+ * @param[in]  th: thread
+ * @return     Scheduling class of its process
+ */
+struct sched_class*
+sched_class(struct proc *th)
+{
+  return sched_classes[main_thread(th)->type];
+}
+
+/* Function: change_class
+ * ------------------------
+ * @group      Scheduler
+ * @brief      Move a process to another scheduling class.
+ * @note       The run queue of the process must be locked.
+ * @param[in]  thmain: main thread of the process
+ * @param[in]  type: new scheduling class
+ * @param[in]  tickets: tickets of STRIDE, otherwise 0
+ * @param[in]  weight: weight of FAIR
+ */
+static void
+change_class(struct proc *thmain, enum schedtype type,
+             int tickets, int weight)
+{
+  struct rq *rq = thmain->rq;
+
+  sched_class(thmain)->detach(rq, thmain);
+  thmain->tickets = tickets;
+  thmain->weight = weight;
+  threads_apply1(thmain, __routine_set_type, (void*)type);
+  sched_class(thmain)->attach(rq, thmain);
+}
+
 /* Function: set_cpu_share
  * ------------------------
  * @group      Stride
  * @brief      Guarantee the fair share of cpu time to process
  *             according to the stride scheduling algorithm.
- * @note1      If the type of the current process was MLFQ,
+ * @note1      If the process wasn't STRIDE,
  *             it changes the type to STRIDE.
  *             Otherwise if the type was STRIDE, then it just
  *             modifies the tickets of process.
@@ -94,314 +132,619 @@ ready_proc(struct proc *p)
 int
 set_cpu_share(int share)
 {
-  struct proc *p;
   struct proc *thmain;
+  struct rq *rq;
   int remain;
-  int minpass, mlfqpass;
 
   if(share < 1 || share > 100 - RESERVE)
     return -1;
 
   acquire(&ptable.lock);
-  p = myproc();
-  thmain = main_thread(p);
-  remain = ptable.mlfq.tickets;
-  if(p->type == STRIDE)
-    remain += thmain->tickets;
+  thmain = main_thread(myproc());
+  rq = rq_lock_proc(thmain);
+  // Only stride processes hold tickets.
+  remain = ptable.tickets + thmain->tickets;
   if(remain - share >= RESERVE){
-    if(p->type == MLFQ){
-      dequeue_proc(p);
-      minpass = getminpass();
-      mlfqpass = ptable.mlfq.pass;
-      thmain->pass = minpass < mlfqpass ? minpass : mlfqpass;
-      threads_apply0(thmain, __routine_set_stride);
-      list_add(&p->run, &ptable.stride.run);
-    }
-    ptable.mlfq.tickets = remain - share;
-    thmain->tickets = share;
+    change_class(thmain, STRIDE, share, thmain->weight);
+    ptable.tickets = remain - share;
+    release(&rq->lock);
     release(&ptable.lock);
     return 0;
   } else {
+    release(&rq->lock);
     release(&ptable.lock);
     return -1;
   }
 }
 
-/* Function: getminpass
+/* Function: setsched
  * ------------------------
- * @group      Stride
- * @brief      Get a minimum pass value of the stride heap.
- * @note       If there isn't any process in the stride heap,
- *             it returns a maximum value.
- * @return     Minimum pass value of the stride heap
+ * @group      Scheduler
+ * @brief      Change the scheduling class of the current process.
+ * @note       Children inherit the class, except for STRIDE.
+ * @param[in]  type: MLFQ, STRIDE or FAIR (see sched.h)
+ * @param[in]  param: share (%) of STRIDE or weight of FAIR
+ * @return     If it successes then 0 else -1
  */
-static int
-getminpass(void)
+int
+setsched(int type, int param)
 {
-  return ptable.stride.size > 0 ?
-    main_thread(ptable.stride.minheap[1])->pass : MAXINT;
+  struct proc *thmain;
+  struct rq *rq;
+  int weight;
+
+  if(type == STRIDE)
+    return set_cpu_share(param);
+  if(type != MLFQ && type != FAIR)
+    return -1;
+  if(type == FAIR && (param < 0 || param > FAIR_MAXWEIGHT))
+    return -1;
+
+  acquire(&ptable.lock);
+  thmain = main_thread(myproc());
+  rq = rq_lock_proc(thmain);
+  ptable.tickets += thmain->tickets;
+  weight = type == FAIR && param ? param : thmain->weight;
+  change_class(thmain, type, 0, weight);
+  release(&rq->lock);
+  release(&ptable.lock);
+  return 0;
 }
 
-/* Function: pushheap
+/* Function: setdeadline
  * ------------------------
- * @group      Stride
- * @brief      Push a stride type process.
- * @note1      In stride heap, thread states are as following:
- *             RUNNABLE, SLEEPING
- * @note2      In a process, only one thread has to be in the heap.
- * @param[in]  p: stride type process
+ * @group      Deadline
+ * @brief      Make the current process a deadline process,
+ *             which gets runtime ticks in every period ticks
+ *             and must finish them by deadline ticks.
+ * @note       Admission control: the density runtime/deadline (%)
+ *             is taken from the tickets like the share of stride,
+ *             so that RESERVE tickets always remain for MLFQ.
+ *             It equals the utilization runtime/period unless the
+ *             deadline is shorter, when the utilization alone
+ *             wouldn't guarantee the deadlines under EDF.
+ * @param[in]  runtime: budget per period
+ * @param[in]  deadline: relative deadline in a period
+ * @param[in]  period: period
+ * @return     If it successes then 0 else -1
  */
-static void
-pushheap(struct proc *p)
+int
+setdeadline(int runtime, int deadline, int period)
 {
-  int i = ++ptable.stride.size;
-  struct proc *thmain = main_thread(p);
-  struct proc **minheap = ptable.stride.minheap;
+  struct proc *thmain;
+  struct list_head *itr;
+  struct rq *rq;
+  int share, remain;
+
+  if(runtime < 1 || runtime > deadline || deadline > period)
+    return -1;
+  share = (runtime * 100 + deadline - 1) / deadline;
 
-  while(i != 1 && thmain->pass < main_thread(minheap[i/2])->pass){
-    minheap[i] = minheap[i/2];
-    i /= 2;
+  acquire(&ptable.lock);
+  thmain = main_thread(myproc());
+  rq = rq_lock_proc(thmain);
+  remain = ptable.tickets + thmain->tickets;
+  if(remain - share < RESERVE){
+    release(&rq->lock);
+    release(&ptable.lock);
+    return -1;
   }
-  minheap[i] = p;
+  thmain->dl_runtime = runtime;
+  thmain->dl_deadline = deadline;
+  thmain->dl_period = period;
+  thmain->dl_next = ticks;  // a new period from now
+  change_class(thmain, DEADLINE, share, thmain->weight);
+  ptable.tickets = remain - share;
+  // Its running threads must tick to be charged (see update_tick).
+  for(itr = thmain->runq.next; itr != &thmain->runq; itr = itr->next)
+    kick_tickless(list_entry(itr, struct proc, run)->last_cpu);
+  release(&rq->lock);
+  release(&ptable.lock);
+  return 0;
 }
 
-/* Function: popheap
+/* Function: setgang
  * ------------------------
- * @group      Stride
- * @brief      Pop a process which has a minimum pass value
- *             from the stride minheap
- * @note       When it is called, the size of heap must be more than 1
- * @return     Stride type process which has a minimum pass
+ * @group      Scheduler
+ * @brief      Turn on or off gang scheduling of the current process.
+ * @note       The ready threads of a gang process are dispatched
+ *             on different CPUs together with the thread its home
+ *             CPU runs, and they are descheduled together.
+ * @param[in]  on: 1 to turn on, 0 to turn off
+ * @return     0
  */
-static struct proc*
-popheap()
+int
+setgang(int on)
 {
-  int parent, child;
-  struct proc **minheap = ptable.stride.minheap;
-  struct proc *min = minheap[1];
-  struct proc *last = minheap[ptable.stride.size--];
-
-  for(parent=1, child=2; child <= ptable.stride.size; parent=child, child*=2){
-    if(child < ptable.stride.size && 
-       main_thread(minheap[child])->pass >
-       main_thread(minheap[child+1])->pass)
-      child++;
-    if(main_thread(last)->pass <= main_thread(minheap[child])->pass)
-      break;
-    minheap[parent] = minheap[child];
-  }
-  minheap[parent] = last;
+  struct proc *thmain;
+  struct rq *rq;
 
-  return min;
+  acquire(&ptable.lock);
+  thmain = main_thread(myproc());
+  rq = rq_lock_proc(thmain);
+  thmain->gang = on != 0;
+  release(&rq->lock);
+  release(&ptable.lock);
+  return 0;
 }
 
-/* Function: is_proc_pinned
+/* Function: setaffinity
  * ------------------------
- * @group      MLFQ
- * @brief      Check whether the process is pinned.
- * @param[in]  p: process
- * @param[in]  pin: pin
- * @return     If p is pinned then 1 else 0
+ * @group      Scheduler
+ * @brief      Restrict the CPUs a thread or a process may run on.
+ * @note1      A process whose home CPU isn't allowed any more
+ *             is taken by an allowed CPU through stealing.
+ * @note2      If the calling thread isn't allowed on the current
+ *             CPU, it yields to move at once.
+ * @param[in]  tid: thread of the current process,
+ *                  or -1 for all of its threads
+ * @param[in]  cpumask: bit i allows cpu i
+ * @return     If it successes then 0 else -1
  */
-static int
-is_proc_pinned(struct proc *p, struct list_head* pin)
+int
+setaffinity(int tid, uint cpumask)
 {
-  struct proc* th;
-  th = threads_apply1(p, __routine_is_pinned, pin);
-  return th != 0 ? 1 : 0;
-}
+  struct proc *thmain, *th;
+  struct rq *rq;
+  int moved;
 
-/* Function: pin_next_thread
- * -------------------------
- * @group      MLFQ
- * @brief      Pin on next thread in MLFQ
- * @param[in]  th: current thread
- * @param[in]  self: if 1, include current thread
- *                   else (0), exclude current thread
- */
-static void
-pin_next_thread(struct proc *th, int self){
-  struct proc *nxt;
-  struct list_head **ppin;
-  int level;
-
-  level = main_thread(th)->privlevel;
-  ppin = &ptable.mlfq.pin[level];
-  if(is_proc_pinned(th, *ppin)){
-    nxt = ready_thread(th);
-    if(nxt != 0 && (self || nxt != th)){
-      *ppin = &nxt->mlfq;
-    } else {
-      nxt = ready_or_running_thread(th);
-      if(nxt == 0)
-        panic("pin next thread");
-      nxt = ready_proc(nxt);
-      *ppin = nxt != 0 ? &nxt->mlfq : &ptable.mlfq.queue[level];
-    }
+  cpumask &= (1 << ncpu) - 1;
+  if(cpumask == 0)
+    return -1;
+
+  acquire(&ptable.lock);
+  thmain = main_thread(myproc());
+  th = thmain;
+  if(tid >= 0 && (th = get_thread(thmain, tid)) == 0){
+    release(&ptable.lock);
+    return -1;
   }
+  rq = rq_lock_proc(thmain);
+  if(tid < 0)
+    threads_apply1(thmain, __routine_set_affinity, (void*)cpumask);
+  else
+    th->cpumask = cpumask;
+  release(&rq->lock);
+  release(&ptable.lock);
+
+  pushcli();
+  moved = !CPU_ALLOWED(myproc(), cpuid());
+  popcli();
+  if(moved)
+    yield();
+  return 0;
 }
 
-/* Function: pin_next_proc
- * -------------------------
- * @group      MLFQ
- * @brief      Pin on next process in MLFQ.
- * @param[in]  p: current process
- * @param[in]  self: if 1, include current process
- *                   else (0), exclude current process
+/* Function: getaffinity
+ * ------------------------
+ * @group      Scheduler
+ * @brief      Get the CPUs a thread or a process may run on.
+ * @param[in]  tid: thread of the current process,
+ *                  or -1 for all of its threads
+ * @return     CPU mask (the union for a process), or -1
  */
-static void
-pin_next_proc(struct proc *p, int self){
-  struct proc *nxt;
-  struct list_head **ppin;
-  int level;
-
-  level = main_thread(p)->privlevel;
-  ppin = &ptable.mlfq.pin[level];
-  if(is_proc_pinned(p, *ppin)){
-    nxt = ready_or_running_thread(p);
-    if(nxt == 0)
-      panic("pin next proc");
-    nxt = ready_proc(nxt);
-    if(nxt != 0){
-      *ppin = &nxt->mlfq;
-    } else {
-      if(self){
-        nxt = ready_thread(p);
-        *ppin = nxt != 0 ? &nxt->mlfq : &ptable.mlfq.queue[level];
-      } else {
-        *ppin = &ptable.mlfq.queue[level];
-      }
-    }
-  }
+int
+getaffinity(int tid)
+{
+  struct proc *thmain, *th;
+  uint cpumask = 0;
+
+  acquire(&ptable.lock);
+  thmain = main_thread(myproc());
+  if(tid < 0)
+    threads_apply1(thmain, __routine_get_affinity, &cpumask);
+  else if((th = get_thread(thmain, tid)) != 0)
+    cpumask = th->cpumask;
+  release(&ptable.lock);
+  if(cpumask == 0)
+    return -1;
+  return cpumask & ((1 << ncpu) - 1);
 }
 
 /* Function: enqueue_thread
  * -------------------------
- * @group      MLFQ
- * @brief      Enqueue a thread to MLFQ
- * @note1      In MLFQ, thread states are as following:
- *             RUNNING, RUNNABLE
- * @note2      It guarantees gathering of threads of a process.
- *             ex) [p3t0]-[p1t0]-[p1t2]-[p1t1]-[p2t0]
+ * @group      Scheduler
+ * @brief      Enqueue a thread to the ready queue of its process
+ * @note1      In the ready queue, thread states are as following:
+ *             RUNNABLE
+ * @note2      The class of the process puts the process in its
+ *             queues with the first ready thread.
+ *             ex) [queue1]-[p3]-[p1]-[p2]
+ *                           |    |
+ *                         [t0] [t2]-[t1]
  * @param[in]  th: thread to enqueue
  */
 void
 enqueue_thread(struct proc* th)
 {
-  struct proc *pivot;
-  struct list_head *q;
-  int level;
+  struct proc *thmain = main_thread(th);
+  struct rq *rq = thmain->rq;
 
   if(th->state != RUNNABLE)
     panic("enqueue unready thread");
 
-  pivot = ready_or_running_thread(th);
-  if(th == pivot){ // no proc of the thread in queue
-    level = main_thread(th)->privlevel;
-    q = &ptable.mlfq.queue[level];
-    list_add_tail(&th->mlfq, q);
-  } else
-    list_add_after(&th->mlfq, &pivot->mlfq);
+  share_enqueue(th);
+  list_add_tail(&th->ready, &thmain->readyq);
+  thmain->nready++;
+  rq->nr++;
+  sched_class(thmain)->enqueue(rq, th);
+  trace(TRACE_ENQUEUE, th);
 }
 
 /* Function: enqueue_proc
  * -------------------------
- * @group      MLFQ
- * @brief      Enqueue all threads of a process to MLFQ
- * @note1      In MLFQ, thread states are as following:
- *             RUNNING, RUNNABLE
- * @note2      Unlike the stride data structure, MLFQ has multiple
- *             threads of a process.
- * @note3      It guarantees gathering of threads of a process.
- *             ex) [p3t0]-[p1t0]-[p1t2]-[p1t1]-[p2t0]
+ * @group      Scheduler
+ * @brief      Attach a new process to its run queue
+ *             and enqueue all ready threads
  * @param[in]  p: process to enqueue
  */
 static void
 enqueue_proc(struct proc *p)
 {
-  struct list_head *q;
-  int level;
-
-  if(p->state != RUNNABLE && p->state != RUNNING)
-    panic("enqueue proc: RUNNING, RUNNABLE");
+  struct proc *thmain = main_thread(p);
 
-  level = main_thread(p)->privlevel;
-  q = &ptable.mlfq.queue[level];
+  sched_class(thmain)->attach(thmain->rq, thmain);
+  threads_apply0(p, __routine_enqueue_ready);
+}
 
-  list_add_tail(&p->mlfq, q);
-  threads_apply1(p, __routine_enqueue_remain, p);
+/* Function: dequeue_thread
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Dequeue a thread from the ready queue of its process
+ * @note       The class of the process takes the process out of
+ *             its queues with the last ready thread.
+ * @param[in]  th: RUNNABLE thread to dequeue
+ */
+void
+dequeue_thread(struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+  struct rq *rq = thmain->rq;
+
+  list_del(&th->ready);
+  share_dequeue(th);
+  thmain->nready--;
+  rq->nr--;
+  sched_class(thmain)->dequeue(rq, th);
 }
 
-/* Function: concatqueue
+/* Function: set_running
  * -------------------------
- * @group      MLFQ
- * @brief      Concatenate src queue to dst queue of MLFQ.
- * @note       It is called when the priority boost occurs.
- * @param[in]  src: the level of source queue
- * @param[in]  dst: the level of destination queue
- * @example    src: 1, dst: 0
- *             [queue0]     [queue1]     [queue2]
- *             ->[queue0~queue1]  []     [queue2]
+ * @group      Scheduler
+ * @brief      Make a dequeued thread RUNNING on the current cpu.
+ * @note       The thread joins the running list of its process
+ *             until it leaves the cpu in sched_to().
+ * @param[in]  th: thread to dispatch
  */
 static void
-concatqueue(int src, int dst)
+set_running(struct proc *th)
 {
-  struct list_head *srcq = &ptable.mlfq.queue[src];
-  struct list_head *dstq = &ptable.mlfq.queue[dst];
-  struct list_head **spin = &ptable.mlfq.pin[src];
-  struct list_head **dpin = &ptable.mlfq.pin[dst];
+  th->state = RUNNING;
+  th->last_cpu = cpuid();
+  list_add_tail(&th->run, &main_thread(th)->runq);
+}
 
-  if(list_empty(dstq) && *spin != srcq)
-    *dpin = *spin;
-  *spin = srcq;
+/* Function: sleepq
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Get the bucket of the wait-channel table for chan.
+ * @param[in]  chan: wait channel
+ * @return     Sleep queue bucket
+ */
+static struct sleepq*
+sleepq(void *chan)
+{
+  return &ptable.sleepq[SLEEPQ_HASH(chan)];
+}
 
-  list_bulk_move_tail(srcq, dstq);
+/* Function: proc_rq
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Get the home run queue of a thread.
+ * @note       All threads of a process share the run queue
+ *             of the main thread.
+ * @param[in]  th: thread
+ * @return     Home run queue
+ */
+struct rq*
+proc_rq(struct proc *th)
+{
+  return main_thread(th)->rq;
 }
 
-/* Function: dequeue_thread
+/* Function: rq_lock_proc
  * -------------------------
- * @group      MLFQ
- * @brief      Dequeue a thread from MLFQ
- * @param[in]  th: thread to dequeue
+ * @group      Scheduler
+ * @brief      Lock the home run queue of a thread.
+ * @note       The process can migrate until the lock is held,
+ *             so it retries if the home has changed meanwhile.
+ * @param[in]  th: thread
+ * @return     Locked home run queue
+ */
+struct rq*
+rq_lock_proc(struct proc *th)
+{
+  struct rq *rq;
+
+  for(;;){
+    rq = proc_rq(th);
+    acquire(&rq->lock);
+    if(rq == proc_rq(th))
+      return rq;
+    release(&rq->lock);
+  }
+}
+
+/* Function: rq_barrier
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Wait until a dead thread is switched out.
+ * @note       A ZOMBIE thread still runs on its kernel stack
+ *             until the scheduler releases the run queue lock,
+ *             so it must be called before freeing the thread.
+ * @param[in]  th: ZOMBIE thread
  */
 void
-dequeue_thread(struct proc *th)
+rq_barrier(struct proc *th)
+{
+  release(&rq_lock_proc(th)->lock);
+}
+
+/* Function: double_rq_lock
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Lock two run queues in address order.
+ */
+static void
+double_rq_lock(struct rq *rq1, struct rq *rq2)
+{
+  if(rq1 < rq2){
+    acquire(&rq1->lock);
+    acquire(&rq2->lock);
+  } else {
+    acquire(&rq2->lock);
+    acquire(&rq1->lock);
+  }
+}
+
+/* Function: select_rq
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Select the least loaded run queue
+ *             as the home of a new process.
+ * @param[in]  cpumask: CPUs the process may run on
+ * @return     Run queue
+ */
+static struct rq*
+select_rq(uint cpumask)
 {
-  pin_next_thread(th, 0);
-  list_del(&th->mlfq);
+  struct rq *rq, *min;
+
+  min = 0;
+  for(rq = ptable.rq; rq < &ptable.rq[ncpu]; rq++)
+    if(((cpumask >> (rq - ptable.rq)) & 1) &&
+       (min == 0 || rq->nr < min->nr))
+      min = rq;
+  return min ? min : &ptable.rq[0];
 }
 
-/* Function: dequeue_proc
+/* Function: migrate_proc
  * -------------------------
- * @group      MLFQ
- * @brief      Dequeue all threads of the process from MLFQ
- * @param[in]  p: process to dequeue
+ * @group      Scheduler
+ * @brief      Move a process to another run queue.
+ * @note1      Both run queues must be locked and no thread of
+ *             the process may be RUNNING.
+ * @note2      The class moves its own state along on detach
+ *             and attach (e.g. stride tickets and pass).
+ * @param[in]  p: RUNNABLE thread of the process
+ * @param[in]  dst: destination run queue
  */
 static void
-dequeue_proc(struct proc *p)
+migrate_proc(struct proc *p, struct rq *dst)
 {
-  pin_next_proc(p, 0);
-  threads_apply0(p, __routine_dequeue_proc);
+  struct proc *thmain = main_thread(p);
+  struct sched_class *cl = sched_class(thmain);
+  struct rq *src = thmain->rq;
+
+  cl->detach(src, thmain);
+  src->nr -= thmain->nready;
+  thmain->rq = dst;
+  dst->nr += thmain->nready;
+  cl->attach(dst, thmain);
 }
+
+/* Function: pick_next
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Select the next thread of a run queue
+ *             which is allowed to run on the cpu.
+ * @note       Stride backs off for MLFQ and fair work which may
+ *             be pinned to other CPUs, so it is tried again
+ *             if they have nothing for this cpu.
+ * @param[in]  rq: locked run queue
+ * @param[in]  cpu: cpu id
+ * @return     RUNNABLE thread or 0
+ */
+static struct proc*
+pick_next(struct rq *rq, int cpu)
+{
+  struct sched_class **order = pick_order[fair_first(rq)];
+  struct proc *thmain;
+  int i;
+
+  for(i = 0; i < NELEM(pick_order[0]); i++)
+    if((thmain = order[i]->pick_next(rq, cpu)) != 0)
+      return ready_thread_on(thmain, cpu);
+  if((thmain = stride_pick_fallback(rq, cpu)) != 0)
+    return ready_thread_on(thmain, cpu);
+  return 0;
+}
+
+/* Function: gang_start
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Dispatch the other ready threads of a gang process
+ *             on other CPUs at the same time as its leader.
+ * @note       The gang is published in the run queue, and the
+ *             CPUs are interrupted to join it (see gang_pick).
+ * @param[in]  rq: locked home run queue of the process
+ * @param[in]  thmain: main thread of the process
+ * @param[in]  cpu: cpu of the leader
+ */
+static void
+gang_start(struct rq *rq, struct proc *thmain, int cpu)
+{
+  struct cpu *c;
+  int n = thmain->nready;
+
+  rq->gang = thmain;
+  rq->gang_cpu = cpu;
+  for(c = cpus; c < &cpus[ncpu] && n > 0; c++){
+    if(c == &cpus[cpu] || (c->proc && main_thread(c->proc) == thmain))
+      continue;
+    // An idle CPU only needs the interrupt to wake up.
+    if(c->proc)
+      c->resched = 1;
+    lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
+    n--;
+  }
+}
+
+/* Function: gang_end
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Deschedule a gang together with its leader.
+ * @note       It does nothing unless cpu is the gang leader.
+ * @param[in]  rq: locked run queue of the dispatch
+ * @param[in]  thmain: main thread of the process
+ * @param[in]  cpu: current cpu
+ */
+static void
+gang_end(struct rq *rq, struct proc *thmain, int cpu)
+{
+  struct cpu *c;
+
+  if(rq->gang != thmain || rq->gang_cpu != cpu)
+    return;
+  rq->gang = 0;
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c != &cpus[cpu] && c->proc && main_thread(c->proc) == thmain){
+      c->resched = 1;
+      lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
+    }
+  }
+}
+
+/* Function: gang_pick
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Join a gang dispatched from another run queue.
+ * @note       The thread is borrowed like in steal(), and on
+ *             success only the returned run queue is held.
+ * @param[in]  home: run queue of the current cpu
+ * @param[out] pp: thread of the gang
+ * @return     Locked run queue of the gang, or 0
+ */
+static struct rq*
+gang_pick(struct rq *home, struct proc **pp)
+{
+  struct rq *rq;
+  int cpu = home - ptable.rq;
+
+  for(rq = ptable.rq; rq < &ptable.rq[ncpu]; rq++){
+    if(rq == home || rq->gang == 0)
+      continue;
+    acquire(&rq->lock);
+    if(rq->gang != 0 && (*pp = ready_thread_on(rq->gang, cpu)) != 0)
+      return rq;
+    release(&rq->lock);
+  }
+  return 0;
+}
+
+/* Function: steal
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Steal a thread from the busiest run queue.
+ * @note1      If no thread of the process is RUNNING, the
+ *             whole process migrates to the home run queue.
+ *             Otherwise the thread is borrowed only for one
+ *             dispatch and the process stays in the victim.
+ * @note2      If the busiest one has no thread allowed on
+ *             the cpu, the next busiest one is tried.
+ * @note3      On success, only the returned run queue is held.
+ * @param[in]  home: run queue of the current cpu
+ * @param[out] pp: stolen thread
+ * @return     Locked run queue of the stolen thread, or 0
+ */
+static struct rq*
+steal(struct rq *home, struct proc **pp)
+{
+  struct rq *rq, *victim;
+  struct proc *p;
+  int cpu = home - ptable.rq;
+  uint tried = 1 << cpu;
+  int max;
+
+  for(;;){
+    victim = 0;
+    max = 0;
+    for(rq = ptable.rq; rq < &ptable.rq[ncpu]; rq++){
+      if(!(tried & (1 << (rq - ptable.rq))) && rq->nr > max){
+        victim = rq;
+        max = rq->nr;
+      }
+    }
+    if(victim == 0)
+      return 0;
+    tried |= 1 << (victim - ptable.rq);
+
+    double_rq_lock(home, victim);
+    if((p = pick_next(victim, cpu)) != 0)
+      break;
+    release(&victim->lock);
+    release(&home->lock);
+  }
+
+  *pp = p;
+  if(running_thread(p) == 0){
+    migrate_proc(p, home);
+    release(&victim->lock);
+    return home;
+  }
+  release(&home->lock);
+  return victim;
+}
+
 void
 pinit(void)
 {
   struct proc *p;
+  struct rq *rq;
+  struct sleepq *sq;
   int i;
 
   initlock(&ptable.lock, "ptable");
 
-  for(i = 0; i < QSIZE; i++){
-    list_head_init(&ptable.mlfq.queue[i]);
-    ptable.mlfq.pin[i] = &ptable.mlfq.queue[i];
+  for(rq = ptable.rq; rq < &ptable.rq[NCPU]; rq++){
+    initlock(&rq->lock, "rq");
+    for(i = 0; i < QSIZE; i++)
+      list_head_init(&rq->mlfq.queue[i]);
+    list_head_init(&rq->dl.ready);
+    list_head_init(&rq->dl.throttled);
+    rq->tickets = 100;
+  }
+  for(sq = ptable.sleepq; sq < &ptable.sleepq[NSLEEPQ]; sq++){
+    initlock(&sq->lock, "sleepq");
+    list_head_init(&sq->head);
   }
-  list_head_init(&ptable.stride.run);
-  list_head_init(&ptable.sleep);
+  for(i = 0; i < NTIDHASH; i++)
+    list_head_init(&ptable.tidhash[i]);
   list_head_init(&ptable.free);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
     list_add_tail(&p->free, &ptable.free);
 
-  ptable.mlfq.tickets = 100;
+  ptable.tickets = 100;
 }
 
 // Must be called with interrupts disabled
@@ -453,6 +796,7 @@ allocproc(void)
 {
   struct proc *p;
   char *sp;
+  int i;
 
   if(!list_empty(&ptable.free)){
     p = list_first_entry(&ptable.free, struct proc, free);
@@ -467,6 +811,24 @@ found:
   p->state = EMBRYO;
 
   list_head_init(&p->children);
+  list_head_init(&p->readyq);
+  list_head_init(&p->runq);
+  p->nready = 0;
+  p->leader = p;
+  p->rq = 0;
+  p->weight = FAIR_WEIGHT;
+  p->cpumask = CPUMASK_ALL;
+  p->last_cpu = -1;
+  p->gang = 0;
+  p->tgroup = 0;
+  p->tweight = TWEIGHT;
+  p->tpass = 0;
+  p->tshares = 0;
+  for(i = 0; i < NTGROUP; i++){
+    p->tgroups[i].weight = TWEIGHT;
+    p->tgroups[i].pass = 0;
+    list_head_init(&p->tgroups[i].readyq);
+  }
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
@@ -512,8 +874,10 @@ userinit(void)
   p->sz = PGSIZE;
   p->type = MLFQ;
   p->privlevel = 0;
+  p->rq = &ptable.rq[0];
   list_head_init(&p->thgroup);
   p->thmain = p;
+  hash_thread(p);
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -530,38 +894,58 @@ userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  acquire(&p->rq->lock);
 
   p->state = RUNNABLE;
   enqueue_proc(p);
 
-  release(&ptable.lock);
+  release(&p->rq->lock);
 }
 
 // Grow current process's memory by n bytes.
+// Growing only reserves the address space below the
+// user stacks. Pages are allocated on first touch
+// (see pgfault).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, top;
   struct proc *curproc = myproc();
   struct proc *thmain = main_thread(curproc);
+  struct proc *thlast;
 
   acquire(&ptable.lock);
   sz = thmain->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0){
+    // Guard page of the lowest user stack
+    thlast = list_last_entry(&thmain->thgroup, struct proc, thgroup);
+    top = PGROUNDDOWN(thlast->ustack) - PGSIZE;
+    if(sz + n < sz || sz + n > top){
       release(&ptable.lock);
       return -1;
     }
+    thmain->sz = sz + n;
+    release(&ptable.lock);
+    return 0;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0){
+    if(sz + n > sz){
+      release(&ptable.lock);
+      return -1;
+    }
+    // Lower sz first, so that no thread faults
+    // the range in again (see pgfault).
+    acquire(&vmlock);
+    thmain->sz = sz + n;
+    release(&vmlock);
+    if(deallocuvm(curproc->pgdir, sz, sz + n) < 0){
+      acquire(&vmlock);
+      thmain->sz = sz;
+      release(&vmlock);
       release(&ptable.lock);
       return -1;
     }
   }
-  thmain->sz = sz;
-  invalidate_tlb(curproc);
   release(&ptable.lock);
   return 0;
 }
@@ -605,8 +989,13 @@ __routine_fork_thread(struct proc *th, void *main){
   nth->pid = thmain->pid;
   nth->ustack = th->ustack;
   nth->tid = th->tid;
+  nth->cpumask = th->cpumask;
+  nth->tgroup = th->tgroup;
+  nth->tweight = th->tweight;
 
+  nth->leader = thmain;
   list_add_tail(&nth->thgroup, &thmain->thgroup);
+  hash_thread(nth);
   if(th->thmain->tid == 0)
     nth->thmain = thmain;
   else {
@@ -619,6 +1008,7 @@ __routine_fork_thread(struct proc *th, void *main){
 
 static struct proc*
 __routine_rollback_thread(struct proc *th){
+  unhash_thread(th);
   list_del(&th->sibling);
   kfree(th->kstack);
   th->kstack = 0;
@@ -628,22 +1018,38 @@ __routine_rollback_thread(struct proc *th){
   return 0;
 }
 
+/* Function: fork
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Create a child process.
+ * @note       By default every thread of the process is cloned.
+ *             With thonly, only the calling thread is, like POSIX,
+ *             and it becomes the main thread of the child. Then
+ *             the cost doesn't grow with the number of threads.
+ * @param[in]  thonly: if 1, clone only the calling thread
+ * @return     Child pid to the parent, 0 to the child, or -1
+ */
 int
-fork(void)
+fork(int thonly)
 {
   int i, pid, delta, sz;
   struct proc *np, *nxt;
   struct proc *curproc;
   struct proc *curmain;
+  struct proc *self;
   struct proc *th, *nth;
   struct list_head *start, *itr1, *itr2;
+  struct sleepq *sq;
+  struct rq *rq;
 
   acquire(&ptable.lock);
 
   curproc = myproc();
   curmain = main_thread(curproc);
+  // Thread of the caller to become the main thread of the child
+  self = thonly ? curproc : curmain;
 
-  sz = thread_size(curproc);
+  sz = thonly ? 1 : thread_size(curproc);
   if(sz > nproc){
     release(&ptable.lock);
     kprintf_error("require: %d, remain: %d\n", sz, nproc);
@@ -659,7 +1065,8 @@ fork(void)
 
   // Copy process state from proc.
   // main
-  if((np->pgdir = copyuvm(curmain)) == 0){
+  // Share the memory copy-on-write.
+  if((np->pgdir = copyuvm(self, !thonly)) == 0){
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
@@ -675,16 +1082,36 @@ fork(void)
   np->cwd = idup(curmain->cwd);
 
   np->sz = curmain->sz;
-  np->type = MLFQ;
+  // Inherit the class, but not the reserved share
+  // of stride or deadline.
+  np->type = curmain->type == STRIDE || curmain->type == DEADLINE ?
+    MLFQ : curmain->type;
+  np->weight = curmain->weight;
   np->privlevel = 0;
+  np->cpumask = self->cpumask;
+  np->tgroup = self->tgroup;
+  np->tweight = self->tweight;
+  for(i = 0; i < NTGROUP; i++)
+    np->tgroups[i].weight = curmain->tgroups[i].weight;
+  np->tshares = curmain->tshares;
+  np->rq = select_rq(np->cpumask);
   np->tid = 0;
   np->thmain = np;
   list_head_init(&np->thgroup);
+  hash_thread(np);
   np->parent = curproc;
   list_add_tail(&np->sibling, &curproc->children);
-  np->ustack = curmain->ustack;
+  np->ustack = self->ustack;
   safestrcpy(np->name, curmain->name, sizeof(curmain->name));
 
+  if(thonly){
+    *np->tf = *curproc->tf;
+    np->tf->eax = 0;
+    np->state = RUNNABLE;
+    nxt = np;
+    goto done;
+  }
+
   // thread
   if(threads_apply1(curmain, __routine_fork_thread, (void*)np) != 0){
     for(i = 0; i < NOFILE; i++){
@@ -737,22 +1164,130 @@ fork(void)
       nth->state = th->state;
       if(nth->state == SLEEPING){
         nth->chan = th->chan == th ? nth : th->chan;
-        list_add(&nth->sleep, &ptable.sleep);
+        sq = sleepq(nth->chan);
+        acquire(&sq->lock);
+        list_add(&nth->sleep, &sq->head);
+        release(&sq->lock);
       }
     }
     itr1 = itr1->next;
     itr2 = itr2->next;
   } while(itr1 != start);
 
+done:
   pid = np->pid;
 
+  rq = rq_lock_proc(nxt);
   enqueue_proc(nxt);
+  release(&rq->lock);
+  kick_idle(rq, nxt);
 
   release(&ptable.lock);
 
   return pid;
 }
 
+/* Function: spawn
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Create a child process running a program.
+ * @note1      The program is loaded into a new address space
+ *             like exec, so nothing of the caller is copied.
+ * @note2      Without fds, the child inherits every open file.
+ *             With fds, it gets only fds[i] as its fd i
+ *             (0 <= i < 3), and -1 stands for the same fd i,
+ *             which stays closed if it is closed in the caller.
+ * @param[in]  path: program to run
+ * @param[in]  argv: arguments of the program
+ * @param[in]  fds: standard fds of the child, or 0
+ * @return     Child pid, or -1
+ */
+int
+spawn(char *path, char **argv, int *fds)
+{
+  int i, fd, pid;
+  struct proc *np;
+  struct proc *curproc = myproc();
+  struct proc *curmain = main_thread(curproc);
+  struct file *ofile[NOFILE];
+  struct image img;
+  struct rq *rq;
+
+  memset(ofile, 0, sizeof(ofile));
+  for(i = 0; i < NOFILE; i++){
+    fd = i;
+    if(fds != 0 && i >= 3)
+      break;
+    if(fds != 0 && fds[i] >= 0)
+      fd = fds[i];
+    if(fd < NOFILE && curmain->ofile[fd])
+      ofile[i] = filedup(curmain->ofile[fd]);
+    else if(fds != 0 && fds[i] >= 0)
+      goto bad;
+  }
+
+  // Load the program first, since it sleeps on the disk.
+  if(loadimage(path, argv, &img) < 0)
+    goto bad;
+
+  acquire(&ptable.lock);
+  if((np = allocproc()) == 0){
+    release(&ptable.lock);
+    freevm(img.pgdir);
+    goto bad;
+  }
+  np->pid = nextpid++;
+  np->pgdir = img.pgdir;
+  np->sz = img.sz;
+  np->ustack = img.ustack;
+
+  for(i = 0; i < NOFILE; i++)
+    np->ofile[i] = ofile[i];
+  np->cwd = idup(curmain->cwd);
+
+  // Inherit the class like fork.
+  np->type = curmain->type == STRIDE || curmain->type == DEADLINE ?
+    MLFQ : curmain->type;
+  np->weight = curmain->weight;
+  np->privlevel = 0;
+  np->cpumask = curproc->cpumask;
+  np->rq = select_rq(np->cpumask);
+  np->tid = 0;
+  np->thmain = np;
+  list_head_init(&np->thgroup);
+  hash_thread(np);
+  np->parent = curproc;
+  list_add_tail(&np->sibling, &curproc->children);
+  setprogname(np, path);
+
+  memset(np->tf, 0, sizeof(*np->tf));
+  np->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+  np->tf->ds = (SEG_UDATA << 3) | DPL_USER;
+  np->tf->es = np->tf->ds;
+  np->tf->ss = np->tf->ds;
+  np->tf->eflags = FL_IF;
+  np->tf->esp = img.sp;
+  np->tf->eip = img.entry;  // main
+
+  pid = np->pid;
+
+  rq = rq_lock_proc(np);
+  np->state = RUNNABLE;
+  enqueue_proc(np);
+  release(&rq->lock);
+  kick_idle(rq, np);
+
+  release(&ptable.lock);
+
+  return pid;
+
+bad:
+  for(i = 0; i < NOFILE; i++)
+    if(ofile[i])
+      fileclose(ofile[i]);
+  return -1;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -761,6 +1296,7 @@ exit(void)
 {
   struct proc *p, *th, *curproc = myproc();
   struct list_head *children, *itr;
+  struct rq *rq;
   int fd;
   int null = 0;
 
@@ -812,12 +1348,11 @@ exit(void)
                       &initproc->children);
 
   // Jump into the scheduler, never to return.
-  if(curproc->type == MLFQ){
-    dequeue_proc(curproc);
-  } else { // STRIDE
-    ptable.mlfq.tickets += curproc->tickets;
-  }
+  rq = rq_lock_proc(curproc);
+  sched_class(curproc)->detach(rq, curproc);
+  ptable.tickets += curproc->tickets;
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -828,6 +1363,7 @@ freeproc(struct proc *p)
   kfree(p->kstack);
   p->kstack = 0;
   freevm(p->pgdir);
+  unhash_thread(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -835,8 +1371,10 @@ freeproc(struct proc *p)
   p->killed = 0;
   p->tickets = 0;
   p->pass = 0;
+  p->vruntime = 0;
   p->ticks = 0;
   p->privlevel = 0;
+  p->rq = 0;
   p->state = UNUSED;
   nproc++;
   list_add(&p->free, &ptable.free);
@@ -860,6 +1398,7 @@ wait(void)
       if(p->tid == 0 && p->state == ZOMBIE){
         pid = p->pid;
         list_del(itr);
+        rq_barrier(p);
         freeproc(p);
         release(&ptable.lock);
         return pid;
@@ -877,129 +1416,170 @@ wait(void)
   }
 }
 
-struct proc*
-mlfqselect(){
-  struct proc *p;
-  struct list_head *q;
-  struct list_head **ppin;
-  int l;
-
-  for(l = 0; l < QSIZE; l++){
-    q = &ptable.mlfq.queue[l];
-    if(!list_empty(q)){
-      ppin = &ptable.mlfq.pin[l];
-      if(*ppin == q){
-        p = list_first_entry(q, struct proc, mlfq);
-      } else {
-        p = list_entry(*ppin, struct proc, mlfq);
-      }
-      if(p->state == RUNNING){
-        pin_next_thread(p, 0);
-        if(*ppin == q)
-          pin_next_proc(p, 0);
-        if(*ppin == q)
-          continue;
-      }
-      if(main_thread(p)->privlevel != l)
-        panic("mlfqselect");
-      *ppin = &p->mlfq;
-      return p;
-    }
-  }
-
-  return 0;
+/* Function: kick_tickless
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Make a tickless CPU tick again.
+ * @note       It is needed when the run queue of the CPU gets
+ *             a new RUNNABLE thread, or its running thread is
+ *             killed, since nothing would preempt it otherwise.
+ *             Interrupts must be disabled.
+ * @param[in]  cpu: cpu id
+ */
+static void
+kick_tickless(int cpu)
+{
+  struct cpu *c = &cpus[cpu];
+
+  if(cpu < 0 || cpu >= ncpu || !c->tickless)
+    return;
+  if(c == mycpu())
+    update_tick();
+  else
+    lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
 }
 
-static void
-priority_boost(){
-  struct proc *p;
-  struct list_head *q;
-  struct list_head *itr;
-  int l, baselevel = QSIZE-1;
-  // RUNNABLE, RUNNING
-  for(l = 1; l <= baselevel; l++){
-    q = &ptable.mlfq.queue[l];
-    for(itr = q->next; itr != q; itr = itr->next){
-      p = list_entry(itr, struct proc, mlfq);
-      p->privlevel = 0;
-      p->ticks = 0;
-    }
-    concatqueue(l, 0);
-  }
-  // SLEEPING
-  q = &ptable.sleep;
-  for(itr = q->next; itr != q; itr = itr->next){
-    p = list_entry(itr, struct proc, sleep);
-    p->privlevel = 0;
-    p->ticks = 0;
+/* Function: resched_rq
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Make the owner CPU of rq choose again at once.
+ * @note       It is used when a thread more urgent than the
+ *             running one becomes RUNNABLE. The current CPU
+ *             isn't interrupted and waits for its next tick.
+ * @param[in]  rq: run queue
+ */
+void
+resched_rq(struct rq *rq)
+{
+  struct cpu *c = &cpus[rq - ptable.rq];
+
+  pushcli();
+  if(c < &cpus[ncpu] && c != mycpu() && c->proc != 0){
+    c->resched = 1;
+    lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
   }
-  ptable.mlfq.ticks = 0;
+  popcli();
 }
 
+/* Function: update_tick
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Arm the next tick of the current CPU only if
+ *             another thread competes for it.
+ * @note1      A CPU running the only thread of its run queue
+ *             goes tickless until kick_tickless(), and an idle
+ *             CPU has no tick at all (see idle).
+ * @note2      CPU 0 keeps its periodic tick for the global ticks.
+ * @note3      The tickless flag is published before the run
+ *             queue is checked, and kick_idle() checks it after
+ *             the enqueue, so new work can't be missed.
+ * @note4      A thread borrowed from another run queue keeps the
+ *             tick, since new work there kicks the other owner,
+ *             and so does a deadline thread to charge its budget.
+ */
 void
-mlfqlogic(struct proc *p){
-  struct proc *th;
-  struct proc *thmain = main_thread(p);
-  int l, baselevel = QSIZE-1;
-
-  l = thmain->privlevel;
-  if(l < baselevel && thmain->ticks >= TA(l)){
-    dequeue_proc(p);
-    thmain->privlevel = l+1;
-    thmain->ticks = 0;
-    th = ready_or_running_thread(p);
-    if(th != 0)
-      enqueue_proc(th);
-  } else if(thmain->ticks % TQ(l) == 0){
-    pin_next_proc(p, 1);
-  } else {
-    pin_next_thread(p, 1);
+update_tick(void)
+{
+  struct cpu *c;
+  struct rq *rq;
+
+  pushcli();
+  c = mycpu();
+  if(c != cpus){
+    rq = &ptable.rq[c - cpus];
+    xchg(&c->tickless, 1);
+    if(c->proc != 0 && rq->nr == 0 && proc_rq(c->proc) == rq &&
+       main_thread(c->proc)->type != DEADLINE){
+      if(c->ticking){
+        lapictimer(0);
+        c->ticking = 0;
+      }
+    } else {
+      c->tickless = 0;
+      if(!c->ticking){
+        lapictimer(1);
+        c->ticking = 1;
+      }
+    }
   }
+  popcli();
 }
 
+/* Function: kick_idle
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Wake an idle CPU up to run a new RUNNABLE thread.
+ * @note1      The CPU the thread last ran on is preferred for
+ *             its warm cache, then the owner CPU of rq, and
+ *             any other allowed idle CPU can steal it otherwise.
+ * @note2      It must be called after the thread is enqueued,
+ *             so that either the idle CPU sees the work before
+ *             halting or the caller sees the idle flag.
+ * @param[in]  rq: run queue the thread was enqueued to
+ * @param[in]  th: the RUNNABLE thread
+ */
 void
-stridelogic(struct proc *p){
-  struct list_head *q;
-  struct list_head *itr;
-  struct proc *pitr;
-  struct proc *nxt, *thmain;
-  int minpass;
-  int i;
+kick_idle(struct rq *rq, struct proc *th)
+{
+  struct cpu *c, *self;
+  int cpu;
 
-  // Pass overflow handling
-  minpass = p == 0 || p->type == MLFQ ?
-    ptable.mlfq.pass : main_thread(p)->pass;
-  if(minpass > BARRIER){
-    for(i = 1; i <= ptable.stride.size; i++){
-      main_thread(ptable.stride.minheap[i])->pass -= minpass;
-    }
-    q = &ptable.stride.run;
-    for(itr = q->next; itr != q; itr = itr->next){
-      pitr = list_entry(itr, struct proc, run);
-      main_thread(pitr)->pass -= minpass;
-    }
-    ptable.mlfq.pass -= minpass;
+  pushcli();
+  __sync_synchronize();
+  self = mycpu();
+  // The owner may be running alone without a tick.
+  kick_tickless(rq - ptable.rq);
+  cpu = th->last_cpu;
+  if(cpu < 0 || cpu >= ncpu || !CPU_ALLOWED(th, cpu) || !cpus[cpu].idle)
+    cpu = rq - ptable.rq;
+  if(cpu < 0 || cpu >= ncpu || !CPU_ALLOWED(th, cpu) || !cpus[cpu].idle){
+    for(cpu = 0; cpu < ncpu; cpu++)
+      if(cpus[cpu].idle && &cpus[cpu] != self && CPU_ALLOWED(th, cpu))
+        break;
   }
+  c = &cpus[cpu];
+  if(cpu < ncpu && c != self)
+    lapicipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
+  popcli();
+}
+
+/* Function: idle
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Halt the CPU until an interrupt arrives,
+ *             unless any run queue has work to do.
+ * @note       The idle flag is published before the run queues
+ *             are checked, and kick_idle() checks it after the
+ *             enqueue, so a wakeup can't be missed.
+ * @param[in]  c: current CPU
+ */
+static void
+idle(struct cpu *c)
+{
+  struct rq *rq;
 
-  // Pass increases by stride
-  if(p == 0 || p->type == MLFQ){
-    ptable.mlfq.pass += STRD(ptable.mlfq.tickets);
-  } else if(p->type == STRIDE){
-    thmain = main_thread(p);
-    thmain->pass += STRD(thmain->tickets);
-    if((nxt = ready_thread(p)) != 0){
-      pushheap(nxt);
-    } else if((nxt = sleeping_thread(p)) != 0){
-      pushheap(nxt);
+  cli();
+  xchg(&c->idle, 1);
+  for(rq = ptable.rq; rq < &ptable.rq[ncpu]; rq++)
+    if(rq->nr > 0)
+      break;
+  if(rq == &ptable.rq[ncpu]){
+    // Idle CPUs don't tick; CPU 0 keeps the global ticks.
+    if(c != cpus && c->ticking){
+      lapictimer(0);
+      c->ticking = 0;
     }
+    sti_hlt();
   }
+  c->idle = 0;
 }
 
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - choose a process to run from the own run queue,
+//    or steal one from the busiest run queue if idle
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
@@ -1008,70 +1588,71 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int cpu = cpuid();
+  struct rq *home = &ptable.rq[cpu];
+  struct rq *rq;
 
   c->proc = 0;
 
   for(;;){
     sti();
 
-    acquire(&ptable.lock);
-
-    // Select next process
-    p = getminpass() < ptable.mlfq.pass ?
-      popheap() : mlfqselect();
+    // Join a running gang unless deadline jobs are waiting,
+    // or select next process
+    if(!list_empty(&home->dl.ready) || (rq = gang_pick(home, &p)) == 0){
+      acquire(&home->lock);
+      rq = home;
+      if((p = pick_next(rq, cpu)) == 0){
+        release(&rq->lock);
+        if((rq = steal(home, &p)) == 0){
+          idle(c);
+          continue;
+        }
+      }
+    }
 
     // Run process
-    if(p != 0 && p->state == RUNNABLE) {
-      if(p->type == STRIDE)
-        list_add(&p->run, &ptable.stride.run);
+    dequeue_thread(p);
+    c->proc = p;
+    switchuvm(p);
+    set_running(p);
+    main_thread(p)->exec_start = rdtsc();
+    update_tick();
+    trace(TRACE_DISPATCH, p);
+    if(main_thread(p)->gang && rq == proc_rq(p) && rq->gang == 0)
+      gang_start(rq, main_thread(p), cpu);
 
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
+    // The page table stays loaded for the next thread.
+    swtch(&(c->scheduler), p->context);
 
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
+    gang_end(rq, main_thread(c->proc), cpu);
 
-      if(p->type == MLFQ)
-        mlfqlogic(c->proc);
-      else
-        list_del(&p->run);
-    }
-
-    // Priority boost
-    if(ptable.mlfq.ticks >= BOOSTINTERVAL){
-      priority_boost();
-    }
-
-    // Log stride
-    if(p == 0 || p->state == SLEEPING)
-      stridelogic(p);
-    else
-      stridelogic(c->proc);
+    // Charge the class for the whole dispatch
+    if(sched_class(c->proc)->tick)
+      sched_class(c->proc)->tick(rq, c->proc);
 
     c->proc = 0;
 
-    release(&ptable.lock);
+    release(&rq->lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
-// intena because intena is a property of this
-// kernel thread, not this CPU. It should
-// be proc->intena and proc->ncli, but that would
-// break in the few places where a lock is held but
-// there's no process.
-void
-sched(void)
+/* Function: sched_to
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Switch to a RUNNABLE thread of the same process
+ *             directly, or to the scheduler if nxt is 0.
+ * @note       The caller must meet the conditions of sched().
+ * @param[in]  nxt: RUNNABLE thread of the current process or 0
+ */
+static void
+sched_to(struct proc *nxt)
 {
   int intena;
   struct proc *p = myproc();
-  struct proc *thmain = main_thread(p);
-  struct proc *nxt = ready_thread(p);
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&proc_rq(p)->lock))
+    panic("sched rq.lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -1080,37 +1661,122 @@ sched(void)
     panic("sched interruptible");
   intena = mycpu()->intena;
 
-  if(nxt == 0 || thmain->ticks % DTQ == 0){
+  list_del(&p->run);
+  share_charge(p);
+  if(nxt == 0){
     swtch(&p->context, mycpu()->scheduler);
   } else {
+    dequeue_thread(nxt);
     if(p != nxt){
-      vswitchuvm(nxt);
+      switchuvm(nxt);
       mycpu()->proc = nxt;
-      nxt->state = RUNNING;
+      set_running(nxt);
+      trace(TRACE_DISPATCH, nxt);
       swtch(&p->context, nxt->context);
     } else {
-      p->state = RUNNING;
+      set_running(p);
+      trace(TRACE_DISPATCH, p);
     }
   }
   mycpu()->intena = intena;
 }
 
+// Enter scheduler.  Must hold only the run queue lock
+// of the process and have changed proc->state. Saves and restores
+// intena because intena is a property of this
+// kernel thread, not this CPU. It should
+// be proc->intena and proc->ncli, but that would
+// break in the few places where a lock is held but
+// there's no process.
+// Another ready thread of the process runs directly
+// unless the time quantum of the process is over, or it is
+// a deadline process out of budget, which must wait in the
+// throttled list for its next period.
+void
+sched(void)
+{
+  struct proc *p = myproc();
+  struct proc *thmain = main_thread(p);
+  struct proc *nxt = ready_thread_on(p, cpuid());
+
+  if(thmain->ticks % DTQ == 0 ||
+     (thmain->type == DEADLINE && thmain->dl_budget <= 0))
+    nxt = 0;
+  sched_to(nxt);
+}
+
+// Give up the CPU to a more urgent thread.
+// Unlike yield(), it doesn't count a timer tick.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+
+  rq_lock_proc(p);
+  p->state = RUNNABLE;
+  trace(TRACE_PREEMPT, p);
+  enqueue_thread(p);
+  sched_to(0);
+  // The process may have migrated while it was RUNNABLE.
+  release(&proc_rq(p)->lock);
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *thmain;
   struct proc *p;
+  struct rq *rq;
 
-  acquire(&ptable.lock);  //DOC: yieldlock
   p = myproc();
+  rq = rq_lock_proc(p);  //DOC: yieldlock
   thmain = main_thread(p);
+  sched_class(p)->yield(rq, p);
   thmain->ticks++;
-  if(thmain->type == MLFQ)
-    ptable.mlfq.ticks++;
   p->state = RUNNABLE;
+  trace(TRACE_PREEMPT, p);
+  enqueue_thread(p);
+  // Idle CPUs don't tick, so tell one if p moves away.
+  if(!CPU_ALLOWED(p, cpuid()))
+    kick_idle(rq, p);
   sched();
-  release(&ptable.lock);
+  // The process may have migrated while it was RUNNABLE.
+  release(&proc_rq(p)->lock);
+}
+
+/* Function: yield_to
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Give the CPU to another thread of the process.
+ * @note1      It switches to th directly, so th runs right away
+ *             regardless of the time quantum of the process.
+ * @note2      It fails if th isn't RUNNABLE, belongs to another
+ *             process or isn't allowed on the current CPU.
+ * @param[in]  th: thread to run
+ * @return     If it successes then 0 else -1
+ */
+int
+yield_to(struct proc *th)
+{
+  struct proc *p = myproc();
+  struct rq *rq;
+
+  if(th == p)
+    return -1;
+  rq = rq_lock_proc(p);
+  if(th->state != RUNNABLE || main_thread(th) != main_thread(p) ||
+     !CPU_ALLOWED(th, cpuid())){
+    release(&rq->lock);
+    return -1;
+  }
+  p->state = RUNNABLE;
+  trace(TRACE_PREEMPT, p);
+  enqueue_thread(p);
+  sched_to(th);
+  // The process may have migrated while it was RUNNABLE.
+  release(&proc_rq(p)->lock);
+  return 0;
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -1119,8 +1785,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding the run queue lock from scheduler.
+  release(&proc_rq(myproc())->lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -1140,6 +1806,7 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = sleepq(chan);
   
   if(p == 0)
     panic("sleep");
@@ -1147,66 +1814,106 @@ sleep(void *chan, struct spinlock *lk)
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
+  // Must acquire the bucket lock of chan in order to
+  // join its sleep queue.
+  // Once we hold the bucket lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // (wakeup runs with the bucket lock locked),
   // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
-  }
+  acquire(&sq->lock);  //DOC: sleeplock1
+  release(lk);
+  // Must acquire the run queue lock in order to
+  // change p->state and then call sched.
+  rq_lock_proc(p);
+
   // Go to sleep.
   p->chan = chan;
-  if(p->type == MLFQ)
-    dequeue_thread(p);
   p->state = SLEEPING;
-  list_add(&p->sleep, &ptable.sleep);
+  trace(TRACE_SLEEP, p);
+  list_add(&p->sleep, &sq->head);
+
+  // A wakeup has to wait for the run queue lock
+  // until this thread is switched out.
+  release(&sq->lock);
 
   sched();
 
   // Tidy up.
-  myproc()->chan = 0;
+  p->chan = 0;
+  release(&proc_rq(p)->lock);
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  acquire(lk);  //DOC: sleeplock2
 }
 
 //PAGEBREAK!
 // Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-void
-wakeup1(void *chan)
+// Only the bucket of chan is locked, so the ptable lock
+// may or may not be held.
+// An idle CPU is kicked for them if kick is set.
+static void
+wakeup_chan(void *chan, int kick)
 {
   struct proc *p;
+  struct sleepq *sq = sleepq(chan);
   struct list_head *q;
   struct list_head *itr;
+  struct rq *rq;
 
-  q = &ptable.sleep;
+  acquire(&sq->lock);
+  q = &sq->head;
   itr = q->next;
   while(itr != q){
     p = list_entry(itr, struct proc, sleep);
     itr = itr->next;
     if(p->chan == chan){
+      rq = rq_lock_proc(p);
       list_del(&p->sleep);
       p->state = RUNNABLE;
-      if(p->type == MLFQ)
-        enqueue_thread(p);
+      enqueue_thread(p);
+      release(&rq->lock);
+      if(kick)
+        kick_idle(rq, p);
     }
   }
+  release(&sq->lock);
+}
+
+void
+wakeup1(void *chan)
+{
+  wakeup_chan(chan, 1);
+}
+
+// Wake up all processes sleeping on chan, but leave them
+// to the caller, which is going to hand its CPU off to one.
+void
+wakeup_handoff(void *chan)
+{
+  wakeup_chan(chan, 0);
 }
 
 // Wake up all processes sleeping on chan.
 void
 wakeup(void *chan)
 {
-  acquire(&ptable.lock);
   wakeup1(chan);
-  release(&ptable.lock);
+}
+
+/* Function: find_proc
+ * -------------------------
+ * @group      Scheduler
+ * @brief      Find a process by pid.
+ * @note1      The other threads sharing the pid are reached
+ *             through the thread group of the main thread.
+ * @note2      ptable.lock must be held.
+ * @param[in]  pid: process identifier
+ * @return     Main thread of the process or 0
+ */
+struct proc*
+find_proc(int pid)
+{
+  return lookup_thread(pid, 0);
 }
 
 // Kill the process with the given pid.
@@ -1216,24 +1923,38 @@ int
 kill(int pid)
 {
   struct proc *p;
+  struct sleepq *sq;
+  struct rq *rq;
+  void *chan;
 
   acquire(&ptable.lock);
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->pid == pid){
-      terminate_proc(p);
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING){
-        list_del(&p->sleep);
-        p->state = RUNNABLE;
-        if(p->type == MLFQ)
-          enqueue_thread(p);
-      }
-      release(&ptable.lock);
-      return 0;
+  if((p = find_proc(pid)) == 0){
+    release(&ptable.lock);
+    return -1;
+  }
+  terminate_proc(p);
+  // RUNNING threads on tickless CPUs have to trap.
+  pushcli();
+  threads_apply0(p, __routine_kick_running);
+  popcli();
+  // Wake process from sleep if necessary.
+  // The bucket lock of chan keeps it asleep on chan.
+  chan = p->chan;
+  if(p->state == SLEEPING && chan != 0){
+    sq = sleepq(chan);
+    acquire(&sq->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      rq = rq_lock_proc(p);
+      list_del(&p->sleep);
+      p->state = RUNNABLE;
+      enqueue_thread(p);
+      release(&rq->lock);
+      kick_idle(rq, p);
     }
+    release(&sq->lock);
   }
   release(&ptable.lock);
-  return -1;
+  return 0;
 }
 
 //PAGEBREAK: 36
@@ -1264,7 +1985,7 @@ procdump(void)
       state = p->killed ? "killed" : states[p->state];
     else
       state = "???";
-    cprintf("%d %d %d %s %s", p->pid, p->privlevel, p->tid, state, p->name);
+    cprintf("%d %d %d %s %s", p->pid, getlev(main_thread(p)), p->tid, state, p->name);
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
@@ -8,6 +8,11 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *pgdir;                // User page table loaded, or null
+  volatile uint idle;          // Halted in the idle loop?
+  volatile uint tickless;      // Running alone without a tick?
+  volatile uint resched;       // Preempt on the next resched IPI?
+  int ticking;                 // Is a one-shot tick armed?
 };
 
 extern struct cpu cpus[NCPU];
@@ -34,7 +39,24 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-enum schedtype { MLFQ, STRIDE };
+// Scheduling classes; the values match sched.h.
+enum schedtype { MLFQ, STRIDE, FAIR, DEADLINE };
+
+// User image loaded by loadimage() for exec and spawn.
+struct image {
+  pde_t *pgdir;
+  uint sz;
+  uint ustack;                 // Bottom of the user stack
+  uint sp;
+  uint entry;
+};
+
+// Thread group of a process, to divide its share.
+struct tgroup {
+  int weight;
+  uint64 pass;
+  struct list_head readyq;     // RUNNABLE threads by tpass
+};
 
 // Per-thread state
 struct proc {
@@ -57,19 +79,54 @@ struct proc {
   enum schedtype type;
   // Stride fields
   int tickets;
-  int pass;
+  uint64 pass;
+  int heapidx;                 // Index in stride heap, 0 if not in
+  // Fair fields
+  uint64 vruntime;
+  int weight;
+  struct proc *fleft;          // AVL tree of fair class
+  struct proc *fright;
+  int fheight;                 // 0 if not in the tree
+  uint64 exec_start;           // tsc of the last dispatch
+  // Thread share fields
+  int tgroup;                  // Thread group in the process
+  int tweight;                 // Weight in the thread group
+  uint64 tpass;
+  struct list_head gready;     // Entry in readyq of its thread group
+  struct tgroup tgroups[NTGROUP]; // Thread groups (main thread)
+  int tshares;                 // Shares ever set? (main thread)
+  int gang;                    // Gang scheduled? (main thread)
+  // Deadline fields (in ticks)
+  uint dl_runtime;             // Budget per period
+  uint dl_deadline;            // Relative to the period start
+  uint dl_period;
+  uint dl_abs;                 // Absolute deadline of the job
+  uint dl_next;                // Start of the next period
+  int dl_budget;               // Budget left in the period
+  struct list_head dl;         // Entry in the deadline queues
   // MLFQ fields
   uint ticks;
-  int privlevel;
+  int privlevel;               // valid only in the epoch (main thread)
+  uint epoch;                  // boost epoch of privlevel and ticks
   // General queue fields
   struct list_head sleep;
   struct list_head mlfq;
   struct list_head free;
-  struct list_head run;
+  struct list_head ready;      // Entry in readyq of main thread
+  struct list_head readyq;     // RUNNABLE threads (main thread)
+  struct list_head run;        // Entry in runq of main thread
+  struct list_head runq;       // RUNNING threads (main thread)
+  int nready;                  // # of RUNNABLE threads (main thread)
+  struct rq *rq;               // Home run queue (main thread)
+  // Affinity fields
+  uint cpumask;                // CPUs the thread may run on
+  int last_cpu;                // CPU the thread last ran on, or -1
   // Thread
   thread_t tid;
-  struct proc *thmain;
+  struct proc *thmain;         // Joining thread
+  struct proc *leader;         // Main thread of the process
   struct list_head thgroup;
+  struct list_head tidlink;    // Entry in tidhash of ptable
   void *retval;
 };
 
@@ -0,0 +1,6 @@
+// Scheduling classes of setsched().
+// Shared by the kernel and user programs.
+#define SCHED_MLFQ    0    // default
+#define SCHED_STRIDE  1    // param: cpu share (%), as set_cpu_share()
+#define SCHED_FAIR    2    // param: weight, 0 for the default
+#define SCHED_DEADLINE 3   // set by setdeadline()
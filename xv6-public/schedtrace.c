@@ -0,0 +1,179 @@
+// Print histograms of scheduler wait time, i.e. the time
+// between becoming RUNNABLE and RUNNING, per MLFQ level
+// and for stride, fair and deadline processes.
+//
+// usage: schedtrace [ticks]
+// ex) $ mlfqtest &
+//     $ schedtrace 300
+
+#include "types.h"
+#include "param.h"
+#include "user.h"
+#include "trace.h"
+
+#define NBATCH   (NCPU*NTRACE)  // the rings of every cpu
+#define NPENDING 256     // tracked RUNNABLE threads
+#define NLEVEL   3       // MLFQ level 0-2
+#define NCLASS   6       // MLFQ levels, stride, fair, deadline
+#define NBUCKET  32      // log2 buckets of tsc cycles, the last open
+
+struct pending {
+  int pid;
+  int tid;
+  int class;
+  uint64 tsc;
+};
+
+struct trace_event buf[NBATCH];
+struct trace_event tmp[NBATCH];
+struct pending pending[NPENDING];
+int npending;
+uint hist[NCLASS][NBUCKET];
+uint nevent[5];
+
+int
+log2(uint64 v)
+{
+  int k = 0;
+
+  while(v >>= 1)
+    k++;
+  return k;
+}
+
+// Events of different cpus come out in separate runs,
+// so merge them by tsc.
+void
+sort(struct trace_event *ev, int n)
+{
+  int w, lo, mid, hi, i, j, k;
+
+  for(w = 1; w < n; w *= 2){
+    for(lo = 0; lo < n; lo += 2*w){
+      mid = lo + w < n ? lo + w : n;
+      hi = lo + 2*w < n ? lo + 2*w : n;
+      i = lo;
+      j = mid;
+      k = lo;
+      while(i < mid && j < hi)
+        tmp[k++] = ev[j].tsc < ev[i].tsc ? ev[j++] : ev[i++];
+      while(i < mid)
+        tmp[k++] = ev[i++];
+      while(j < hi)
+        tmp[k++] = ev[j++];
+    }
+    memmove(ev, tmp, n * sizeof(ev[0]));
+  }
+}
+
+struct pending*
+lookup(int pid, int tid)
+{
+  int i;
+
+  for(i = 0; i < npending; i++)
+    if(pending[i].pid == pid && pending[i].tid == tid)
+      return &pending[i];
+  return 0;
+}
+
+// A dispatch drained before its enqueue leaves the enqueue
+// unmatched for good, so the oldest entry makes room.
+struct pending*
+oldest(void)
+{
+  struct pending *p = &pending[0];
+  int i;
+
+  for(i = 1; i < npending; i++)
+    if(pending[i].tsc < p->tsc)
+      p = &pending[i];
+  return p;
+}
+
+void
+account(struct trace_event *e)
+{
+  struct pending *p;
+  int b;
+
+  if(e->type < sizeof(nevent)/sizeof(nevent[0]))
+    nevent[e->type]++;
+  p = lookup(e->pid, e->tid);
+  switch(e->type){
+  case TRACE_ENQUEUE:
+    if(p == 0)
+      p = npending < NPENDING ? &pending[npending++] : oldest();
+    p->pid = e->pid;
+    p->tid = e->tid;
+    // level -1 is stride, -2 is fair and -3 is deadline
+    p->class = e->level < 0 ? NLEVEL-1 - e->level : e->level;
+    p->tsc = e->tsc;
+    break;
+  case TRACE_DISPATCH:
+    if(p == 0)
+      return;
+    if(e->tsc > p->tsc){
+      b = log2(e->tsc - p->tsc);
+      hist[p->class][b < NBUCKET ? b : NBUCKET-1]++;
+    }
+    *p = pending[--npending];
+    break;
+  }
+}
+
+void
+report(void)
+{
+  int c, b;
+  uint total;
+
+  printf(1, "enqueue %d, dispatch %d, preempt %d, sleep %d\n",
+         nevent[TRACE_ENQUEUE], nevent[TRACE_DISPATCH],
+         nevent[TRACE_PREEMPT], nevent[TRACE_SLEEP]);
+  for(c = 0; c < NCLASS; c++){
+    total = 0;
+    for(b = 0; b < NBUCKET; b++)
+      total += hist[c][b];
+    if(total == 0)
+      continue;
+    if(c == NLEVEL)
+      printf(1, "stride: %d waits\n", total);
+    else if(c == NLEVEL+1)
+      printf(1, "fair: %d waits\n", total);
+    else if(c == NLEVEL+2)
+      printf(1, "deadline: %d waits\n", total);
+    else
+      printf(1, "level %d: %d waits\n", c, total);
+    for(b = 0; b < NBUCKET-1; b++)
+      if(hist[c][b] > 0)
+        printf(1, "  < 2^%d cycles: %d\n", b+1, hist[c][b]);
+    if(hist[c][b] > 0)
+      printf(1, "  >= 2^%d cycles: %d\n", b, hist[c][b]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, end;
+  int duration = 100;
+
+  if(argc > 1)
+    duration = atoi(argv[1]);
+
+  // Discard stale events.
+  while(gettrace(buf, NBATCH) > 0)
+    ;
+  end = uptime() + duration;
+  while(uptime() < end){
+    sleep(1);
+    while((n = gettrace(buf, NBATCH)) > 0){
+      sort(buf, n);
+      for(i = 0; i < n; i++)
+        account(&buf[i]);
+    }
+  }
+  report();
+  exit();
+}
@@ -2,31 +2,127 @@
 #define TQ(l)    ((l)==0 ? 5 : 10*(l))
 #define TA(l)    (4*TQ(l))
 #define LARGENUM 1000
-#define MAXINT   0x7fffffff
-#define BARRIER  0x6fffffff
+#define MAXPASS  (~0ULL)
 #define STRD(t)  (LARGENUM / (t))
+#define TWEIGHT  10            // default weight of threads and thread groups
+
+#define FAIR_WEIGHT    1024      // default weight of fair class
+#define FAIR_MAXWEIGHT (1 << 16)
+
+#define CPUMASK_ALL    (~0U)
+#define CPU_ALLOWED(th, cpu) (((th)->cpumask >> (cpu)) & 1)
+
+// Scheduling class.
+// Every class keeps its own queues in the run queue and is
+// driven through these operations with the run queue locked.
+// Threads are enqueued and dequeued one by one after the
+// ready queue of their process is updated, so nready tells
+// the first and the last ready thread. Queued entities are
+// processes, identified by their main threads.
+struct sched_class {
+  char *name;
+  // A thread became RUNNABLE.
+  void (*enqueue)(struct rq*, struct proc*);
+  // A RUNNABLE thread was dispatched.
+  void (*dequeue)(struct rq*, struct proc*);
+  // Choose a process with a RUNNABLE thread allowed
+  // on the cpu, or 0.
+  struct proc* (*pick_next)(struct rq*, int);
+  // A dispatched thread came back to the scheduler.
+  // Optional: deadline is charged by timer ticks only.
+  void (*tick)(struct rq*, struct proc*);
+  // A running thread used up a timer tick.
+  void (*yield)(struct rq*, struct proc*);
+  // A process joins or leaves the run queue with its
+  // ready threads (fork, exit, migration, class change).
+  void (*attach)(struct rq*, struct proc*);
+  void (*detach)(struct rq*, struct proc*);
+};
+
+extern struct sched_class dl_class;
+extern struct sched_class mlfq_class;
+extern struct sched_class stride_class;
+extern struct sched_class fair_class;
+struct proc* stride_pick_fallback(struct rq*, int);
+int fair_first(struct rq*);
+void fair_charge_mlfq(struct rq*, struct proc*);
 
 struct mlfq {
-  // Stride fields
-  int tickets;
-  int pass;
-  // MLFQ fields
   uint ticks;
-  struct list_head queue[QSIZE]; // RUNNING & RUNNABLE
-  struct list_head* pin[QSIZE];
+  uint epoch;                    // # of priority boosts
+  uint bitmap;                   // bit l is set if queue[l] is not empty
+  struct list_head queue[QSIZE]; // processes with RUNNABLE threads
 };
 
+// Passes are 64-bit virtual times, so they never wrap
+// in practice and need no rebasing.
 struct stride {
   int size;                      // Size of minheap
-  struct proc* minheap[NPROC];   // RUNNABLE & SLEEPING
-  struct list_head run;          // RUNNING
+  struct proc* minheap[NPROC+1]; // main threads with RUNNABLE threads
 };
 
-struct ptable {
+struct deadline {
+  struct list_head ready;        // by absolute deadline
+  struct list_head throttled;    // out of budget until next period
+};
+
+struct fair {
+  struct proc *root;             // AVL tree of processes by vruntime
+  uint64 min_vruntime;
+  uint64 mlfq_vruntime;          // of MLFQ as a whole
+};
+
+// Per-CPU run queue.
+// A process lives in exactly one run queue (its home),
+// which is recorded in the rq field of the main thread.
+// The lock protects the queues and the scheduling state
+// of every thread whose home is this run queue, and it is
+// the lock held across swtch() instead of ptable.lock.
+struct rq {
   struct spinlock lock;
-  struct proc proc[NPROC];
+  // MLFQ and fair classes together are a single
+  // client of stride scheduling.
+  int tickets;                   // tickets left for them
+  uint64 pass;
+  struct deadline dl;
   struct mlfq mlfq;
   struct stride stride;
-  struct list_head sleep;
+  struct fair fair;
+  int nr;                        // # of RUNNABLE threads
+  struct proc *gang;             // gang dispatched from here, or 0
+  int gang_cpu;                  // cpu of the gang leader
+};
+
+// Wait-channel table.
+// Sleepers are hashed by chan into buckets, and the lock of
+// a bucket protects its list and the SLEEPING state of every
+// thread on it, so a wakeup touches only the matching waiters.
+#define SLEEPQBITS 6
+#define NSLEEPQ    (1 << SLEEPQBITS)
+#define SLEEPQ_HASH(chan) \
+  ((((uint)(chan) >> 2) * 2654435761U) >> (32 - SLEEPQBITS))
+
+struct sleepq {
+  struct spinlock lock;
+  struct list_head head;         // SLEEPING
+};
+
+// Process and thread index.
+// Threads are hashed by (pid, tid), so a thread of a process
+// is found without walking its thread group, and a process is
+// found by pid through its main thread (tid 0).
+// It is protected by the ptable lock.
+#define TIDHASHBITS 6
+#define NTIDHASH    (1 << TIDHASHBITS)
+#define TIDHASH(pid, tid) \
+  ((((uint)(pid) << 8 ^ (uint)(tid)) * 2654435761U) >> (32 - TIDHASHBITS))
+
+struct ptable {
+  struct spinlock lock;
+  struct proc proc[NPROC];
+  struct rq rq[NCPU];
+  int tickets;                   // system-wide tickets left for mlfq
+  struct sleepq sleepq[NSLEEPQ];
+  struct list_head tidhash[NTIDHASH];
   struct list_head free;
 };
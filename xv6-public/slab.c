@@ -0,0 +1,177 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one size, which are carved
+// from slabs: pages from kalloc, with a header followed by
+// the objects. Free objects of a slab are linked through
+// their first word. A slab with no free object is on no list,
+// and an empty one goes back to kalloc.
+//
+// Every cpu keeps a magazine of free objects per cache and
+// takes the cache lock only to refill or flush half of it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "list.h"
+#include "spinlock.h"
+#include "slab.h"
+
+struct slab {
+  struct list_head link;    // on partial of the cache
+  void *free;               // first free object
+  uint inuse;               // objects allocated or in magazines
+};
+
+// Offset of the first object in a slab
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+/* Function: kmem_cache_init
+ * ------------------------
+ * @group      Slab
+ * @brief      Set up a cache of objects of a size.
+ * @param[in]  kc: cache
+ * @param[in]  name: name of the cache
+ * @param[in]  size: size of an object
+ */
+void
+kmem_cache_init(struct kmem_cache *kc, char *name, uint size)
+{
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if(size > PGSIZE - SLABHDR)
+    panic("kmem_cache_init");
+  kc->name = name;
+  kc->size = size;
+  kc->nobj = (PGSIZE - SLABHDR) / size;
+  initlock(&kc->lock, name);
+  list_head_init(&kc->partial);
+}
+
+/* Function: newslab
+ * ------------------------
+ * @group      Slab
+ * @brief      Carve a new page into free objects.
+ * @param[in]  kc: locked cache
+ * @return     The slab, or 0 if out of memory
+ */
+static struct slab*
+newslab(struct kmem_cache *kc)
+{
+  struct slab *s;
+  char *obj;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->free = 0;
+  s->inuse = 0;
+  for(i = kc->nobj - 1; i >= 0; i--){
+    obj = (char*)s + SLABHDR + i*kc->size;
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  list_add(&s->link, &kc->partial);
+  return s;
+}
+
+/* Function: refill
+ * ------------------------
+ * @group      Slab
+ * @brief      Fill half of an empty magazine from the slabs.
+ * @param[in]  kc: cache
+ * @param[in]  m: magazine of the current cpu
+ */
+static void
+refill(struct kmem_cache *kc, struct magazine *m)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&kc->lock);
+  while(m->n < NMAG/2){
+    if(list_empty(&kc->partial) && newslab(kc) == 0)
+      break;
+    s = list_first_entry(&kc->partial, struct slab, link);
+    obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    if(s->free == 0)
+      list_del(&s->link);
+    m->obj[m->n++] = obj;
+  }
+  release(&kc->lock);
+}
+
+/* Function: flush
+ * ------------------------
+ * @group      Slab
+ * @brief      Return half of a full magazine to the slabs.
+ * @param[in]  kc: cache
+ * @param[in]  m: magazine of the current cpu
+ */
+static void
+flush(struct kmem_cache *kc, struct magazine *m)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&kc->lock);
+  while(m->n > NMAG/2){
+    obj = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint)obj);
+    if(s->free == 0)
+      list_add(&s->link, &kc->partial);
+    *(void**)obj = s->free;
+    s->free = obj;
+    if(--s->inuse == 0){
+      list_del(&s->link);
+      kfree((char*)s);
+    }
+  }
+  release(&kc->lock);
+}
+
+/* Function: kmem_cache_alloc
+ * ------------------------
+ * @group      Slab
+ * @brief      Allocate an object of a cache.
+ * @note       The object isn't zeroed.
+ * @param[in]  kc: cache
+ * @return     The object, or 0 if out of memory
+ */
+void*
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  pushcli();
+  m = &kc->mag[cpuid()];
+  if(m->n == 0)
+    refill(kc, m);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  popcli();
+  return obj;
+}
+
+/* Function: kmem_cache_free
+ * ------------------------
+ * @group      Slab
+ * @brief      Free an object to its cache.
+ * @param[in]  kc: cache
+ * @param[in]  obj: object from kmem_cache_alloc
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+  struct magazine *m;
+
+  pushcli();
+  m = &kc->mag[cpuid()];
+  if(m->n == NMAG)
+    flush(kc, m);
+  m->obj[m->n++] = obj;
+  popcli();
+}
@@ -0,0 +1,16 @@
+// Cache of kernel objects of one size (see slab.c)
+#define NMAG 16  // objects in a magazine
+
+struct magazine {
+  int n;
+  void *obj[NMAG];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                // size of an object
+  uint nobj;                // objects per slab
+  struct spinlock lock;     // protects partial and the slabs
+  struct list_head partial; // slabs with a free object
+  struct magazine mag[NCPU];
+};
@@ -29,9 +29,10 @@ acquire(struct spinlock *lk)
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
+  // The xchg is atomic. A shootdown sent to this cpu
+  // is served meanwhile, since interrupts are off.
   while(xchg(&lk->locked, 1) != 0)
-    ;
+    tlbpoll();
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
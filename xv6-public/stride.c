@@ -0,0 +1,319 @@
+// Stride scheduling class.
+//
+// Stride processes are kept in a min-heap by pass. A process
+// is in the heap if and only if it has a RUNNABLE thread.
+// The other classes together are a single client of stride
+// scheduling, with the pass and tickets of the run queue.
+// While a process is detached from a run queue, its pass
+// is kept relative to the virtual time of the queue.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "list.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "scheduler.h"
+
+/* Function: getminpass
+ * ------------------------
+ * @group      Stride
+ * @brief      Get a minimum pass value of the stride heap.
+ * @note       If there isn't any process in the stride heap,
+ *             it returns a maximum value.
+ * @param[in]  rq: run queue
+ * @return     Minimum pass value of the stride heap
+ */
+static uint64
+getminpass(struct rq *rq)
+{
+  return rq->stride.size > 0 ?
+    rq->stride.minheap[1]->pass : MAXPASS;
+}
+
+/* Function: rq_vtime
+ * -------------------------
+ * @group      Stride
+ * @brief      Get the virtual time of a run queue.
+ * @param[in]  rq: run queue
+ * @return     The smaller pass of stride heap and the other classes
+ */
+static uint64
+rq_vtime(struct rq *rq)
+{
+  uint64 minpass = getminpass(rq);
+  return minpass < rq->pass ? minpass : rq->pass;
+}
+
+/* Function: siftup
+ * ------------------------
+ * @group      Stride
+ * @brief      Move up an entry of the stride heap to its place.
+ * @note       Every entry records its own index in heapidx.
+ * @param[in]  rq: run queue
+ * @param[in]  i: index of the entry
+ */
+static void
+siftup(struct rq *rq, int i)
+{
+  struct proc **minheap = rq->stride.minheap;
+  struct proc *p = minheap[i];
+
+  while(i != 1 && p->pass < minheap[i/2]->pass){
+    minheap[i] = minheap[i/2];
+    minheap[i]->heapidx = i;
+    i /= 2;
+  }
+  minheap[i] = p;
+  p->heapidx = i;
+}
+
+/* Function: siftdown
+ * ------------------------
+ * @group      Stride
+ * @brief      Move down an entry of the stride heap to its place.
+ * @param[in]  rq: run queue
+ * @param[in]  i: index of the entry
+ */
+static void
+siftdown(struct rq *rq, int i)
+{
+  struct proc **minheap = rq->stride.minheap;
+  struct proc *p = minheap[i];
+  int child;
+
+  for(child = 2*i; child <= rq->stride.size; i = child, child = 2*i){
+    if(child < rq->stride.size &&
+       minheap[child]->pass > minheap[child+1]->pass)
+      child++;
+    if(p->pass <= minheap[child]->pass)
+      break;
+    minheap[i] = minheap[child];
+    minheap[i]->heapidx = i;
+  }
+  minheap[i] = p;
+  p->heapidx = i;
+}
+
+/* Function: pushheap
+ * ------------------------
+ * @group      Stride
+ * @brief      Push a stride type process.
+ * @param[in]  thmain: main thread of the stride process
+ */
+static void
+pushheap(struct proc *thmain)
+{
+  struct rq *rq = thmain->rq;
+  int i = ++rq->stride.size;
+
+  rq->stride.minheap[i] = thmain;
+  siftup(rq, i);
+}
+
+/* Function: removeheap
+ * ------------------------
+ * @group      Stride
+ * @brief      Remove a process from any place of the stride heap
+ * @param[in]  thmain: main thread of the stride process
+ */
+static void
+removeheap(struct proc *thmain)
+{
+  struct rq *rq = thmain->rq;
+  struct proc **minheap = rq->stride.minheap;
+  struct proc *last = minheap[rq->stride.size--];
+  int i = thmain->heapidx;
+
+  thmain->heapidx = 0;
+  if(last == thmain)
+    return;
+  minheap[i] = last;
+  siftup(rq, i);
+  siftdown(rq, last->heapidx);
+}
+
+/* Function: fixheap
+ * ------------------------
+ * @group      Stride
+ * @brief      Restore the heap order after the pass changed.
+ * @param[in]  thmain: main thread of the stride process
+ */
+static void
+fixheap(struct proc *thmain)
+{
+  struct rq *rq = thmain->rq;
+
+  siftup(rq, thmain->heapidx);
+  siftdown(rq, thmain->heapidx);
+}
+
+/* Function: stride_enqueue
+ * ------------------------
+ * @group      Stride
+ * @brief      Push a stride process with its first ready thread.
+ * @note       A process can't bank the time it slept,
+ *             so its pass catches up with the virtual time.
+ * @param[in]  rq: locked run queue
+ * @param[in]  th: enqueued thread
+ */
+static void
+stride_enqueue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+  uint64 vtime;
+
+  if(thmain->nready == 1){
+    vtime = rq_vtime(rq);
+    if(thmain->pass < vtime)
+      thmain->pass = vtime;
+    pushheap(thmain);
+  }
+}
+
+static void
+stride_dequeue(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  if(thmain->nready == 0)
+    removeheap(thmain);
+}
+
+/* Function: stride_first
+ * ------------------------
+ * @group      Stride
+ * @brief      Get the process with the minimum pass among those
+ *             with a RUNNABLE thread allowed on the cpu.
+ * @note       The heap is scanned only if the top isn't allowed.
+ * @param[in]  rq: locked run queue
+ * @param[in]  cpu: cpu id
+ * @return     Main thread of the process or 0
+ */
+static struct proc*
+stride_first(struct rq *rq, int cpu)
+{
+  struct proc *p, *min;
+  int i;
+
+  if(rq->stride.size == 0)
+    return 0;
+  min = rq->stride.minheap[1];
+  if(ready_thread_on(min, cpu))
+    return min;
+  min = 0;
+  for(i = 2; i <= rq->stride.size; i++){
+    p = rq->stride.minheap[i];
+    if((min == 0 || p->pass < min->pass) && ready_thread_on(p, cpu))
+      min = p;
+  }
+  return min;
+}
+
+/* Function: stride_pick_next
+ * ------------------------
+ * @group      Stride
+ * @brief      Select the stride process with the minimum pass
+ *             if it is ahead of the other classes.
+ * @note       The other classes compete only while they have a
+ *             RUNNABLE thread. When idle they can't bank their
+ *             share, so their pass catches up with the heap.
+ * @param[in]  rq: locked run queue
+ * @param[in]  cpu: cpu id
+ * @return     Main thread of the selected process or 0
+ */
+static struct proc*
+stride_pick_next(struct rq *rq, int cpu)
+{
+  struct proc *thmain = stride_first(rq, cpu);
+
+  if(thmain == 0)
+    return 0;
+  // MLFQ and fair together are the other client.
+  if(rq->mlfq.bitmap != 0 || rq->fair.root != 0){
+    if(thmain->pass >= rq->pass)
+      return 0;
+  } else if(rq->pass < thmain->pass){
+    rq->pass = thmain->pass;
+  }
+  return thmain;
+}
+
+/* Function: stride_pick_fallback
+ * ------------------------
+ * @group      Stride
+ * @brief      Select the stride process with the minimum pass
+ *             regardless of the other classes.
+ * @note       It is used when the other classes have no work
+ *             allowed on the cpu, even though stride_pick_next
+ *             backed off for them. The other client can't bank
+ *             the time it couldn't run here, so its pass
+ *             catches up.
+ * @param[in]  rq: locked run queue
+ * @param[in]  cpu: cpu id
+ * @return     Main thread of the selected process or 0
+ */
+struct proc*
+stride_pick_fallback(struct rq *rq, int cpu)
+{
+  struct proc *thmain = stride_first(rq, cpu);
+
+  if(thmain != 0 && rq->pass < thmain->pass)
+    rq->pass = thmain->pass;
+  return thmain;
+}
+
+static void
+stride_tick(struct rq *rq, struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+
+  thmain->pass += STRD(thmain->tickets);
+  if(thmain->heapidx != 0)
+    fixheap(thmain);
+}
+
+static void
+stride_yield(struct rq *rq, struct proc *th)
+{
+}
+
+/* Function: stride_attach
+ * ------------------------
+ * @group      Stride
+ * @brief      Take the tickets of a process out of the run queue
+ *             and make its pass absolute.
+ * @param[in]  rq: locked run queue
+ * @param[in]  thmain: main thread of the process
+ */
+static void
+stride_attach(struct rq *rq, struct proc *thmain)
+{
+  rq->tickets -= thmain->tickets;
+  thmain->pass += rq_vtime(rq);
+  if(thmain->nready > 0)
+    pushheap(thmain);
+}
+
+static void
+stride_detach(struct rq *rq, struct proc *thmain)
+{
+  if(thmain->heapidx != 0)
+    removeheap(thmain);
+  thmain->pass -= rq_vtime(rq);
+  rq->tickets += thmain->tickets;
+}
+
+struct sched_class stride_class = {
+  .name      = "stride",
+  .enqueue   = stride_enqueue,
+  .dequeue   = stride_dequeue,
+  .pick_next = stride_pick_next,
+  .tick      = stride_tick,
+  .yield     = stride_yield,
+  .attach    = stride_attach,
+  .detach    = stride_detach,
+};
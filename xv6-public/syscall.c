@@ -135,6 +135,18 @@ extern int sys_futex_wait(void);
 extern int sys_futex_wake(void);
 extern int sys_pread(void);
 extern int sys_pwrite(void);
+extern int sys_gettrace(void);
+extern int sys_setsched(void);
+extern int sys_setaffinity(void);
+extern int sys_getaffinity(void);
+extern int sys_yield_to(void);
+extern int sys_futex_handoff(void);
+extern int sys_set_thread_share(void);
+extern int sys_set_group_share(void);
+extern int sys_setdeadline(void);
+extern int sys_setgang(void);
+extern int sys_tfork(void);
+extern int sys_spawn(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -169,6 +181,18 @@ static int (*syscalls[])(void) = {
 [SYS_futex_wake]    sys_futex_wake,
 [SYS_pread]   sys_pread,
 [SYS_pwrite]  sys_pwrite,
+[SYS_gettrace] sys_gettrace,
+[SYS_setsched] sys_setsched,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_getaffinity] sys_getaffinity,
+[SYS_yield_to] sys_yield_to,
+[SYS_futex_handoff] sys_futex_handoff,
+[SYS_set_thread_share] sys_set_thread_share,
+[SYS_set_group_share] sys_set_group_share,
+[SYS_setdeadline] sys_setdeadline,
+[SYS_setgang] sys_setgang,
+[SYS_tfork] sys_tfork,
+[SYS_spawn] sys_spawn,
 };
 
 void
@@ -31,3 +31,15 @@
 #define SYS_futex_wake    30
 #define SYS_pread  31
 #define SYS_pwrite 32
+#define SYS_gettrace 33
+#define SYS_setsched 34
+#define SYS_setaffinity 35
+#define SYS_getaffinity 36
+#define SYS_yield_to 37
+#define SYS_futex_handoff 38
+#define SYS_set_thread_share 39
+#define SYS_set_group_share 40
+#define SYS_setdeadline 41
+#define SYS_setgang 42
+#define SYS_tfork 43
+#define SYS_spawn 44
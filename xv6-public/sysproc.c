@@ -7,11 +7,18 @@
 #include "mmu.h"
 #include "list.h"
 #include "proc.h"
+#include "trace.h"
 
 int
 sys_fork(void)
 {
-  return fork();
+  return fork(0);
+}
+
+int
+sys_tfork(void)
+{
+  return fork(1);
 }
 
 int
@@ -89,7 +96,8 @@ int
 sys_getlev(void)
 {
   struct proc *p = myproc();
-  return p->type == MLFQ ? p->privlevel : -1;
+  struct proc *thmain = main_thread(p);
+  return thmain->type == MLFQ ? getlev(thmain) : -1;
 }
 
 int
@@ -102,6 +110,78 @@ sys_set_cpu_share(void)
   return set_cpu_share(n);
 }
 
+int
+sys_set_thread_share(void)
+{
+  int thread, group, weight;
+
+  if(argint(0, &thread) < 0 || argint(1, &group) < 0 ||
+     argint(2, &weight) < 0)
+    return -1;
+  return set_thread_share((thread_t)thread, group, weight);
+}
+
+int
+sys_set_group_share(void)
+{
+  int group, weight;
+
+  if(argint(0, &group) < 0 || argint(1, &weight) < 0)
+    return -1;
+  return set_group_share(group, weight);
+}
+
+int
+sys_setsched(void)
+{
+  int type, param;
+
+  if(argint(0, &type) < 0 || argint(1, &param) < 0)
+    return -1;
+  return setsched(type, param);
+}
+
+int
+sys_setdeadline(void)
+{
+  int runtime, deadline, period;
+
+  if(argint(0, &runtime) < 0 || argint(1, &deadline) < 0 ||
+     argint(2, &period) < 0)
+    return -1;
+  return setdeadline(runtime, deadline, period);
+}
+
+int
+sys_setgang(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  return setgang(on);
+}
+
+int
+sys_setaffinity(void)
+{
+  int tid, cpumask;
+
+  if(argint(0, &tid) < 0 || argint(1, &cpumask) < 0)
+    return -1;
+  return setaffinity(tid, (uint)cpumask);
+}
+
+int
+sys_getaffinity(void)
+{
+  int tid;
+
+  if(argint(0, &tid) < 0)
+    return -1;
+  return getaffinity(tid);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 int
@@ -171,3 +251,37 @@ sys_futex_wake(void)
     return -1;
   return futex_wake((thread_t*)addr);
 }
+
+int
+sys_futex_handoff(void)
+{
+  int addr;
+  if(argint(0, &addr) < 0)
+    return -1;
+  return futex_handoff((thread_t*)addr);
+}
+
+int
+sys_yield_to(void)
+{
+  int tid;
+  struct proc *th;
+
+  if(argint(0, &tid) < 0)
+    return -1;
+  if((th = find_thread((thread_t)tid)) == 0)
+    return -1;
+  return yield_to(th);
+}
+
+int
+sys_gettrace(void)
+{
+  char *buf;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 ||
+     argptr(0, &buf, n*sizeof(struct trace_event)) < 0)
+    return -1;
+  return trace_drain((struct trace_event*)buf, n);
+}
@@ -0,0 +1,81 @@
+#include "types.h"
+#include "user.h"
+
+// Test setaffinity and getaffinity on a process and its threads.
+
+volatile int done;
+
+void
+fail(char *msg)
+{
+  printf(1, "affinity test failed: %s\n", msg);
+  exit();
+}
+
+void*
+spinmain(void *arg)
+{
+  while(!done)
+    ;
+  thread_exit(0);
+  return 0;
+}
+
+int
+main(void)
+{
+  thread_t th;
+  void *retval;
+  uint all, mask;
+  int i, n;
+
+  printf(1, "affinity test start\n");
+
+  if((int)(all = getaffinity(-1)) <= 0)
+    fail("getaffinity");
+  if(getaffinity(gettid()) != all)
+    fail("getaffinity of the main thread");
+  if(setaffinity(-1, 0) != -1)
+    fail("setaffinity with no CPU");
+  if(setaffinity(-1, ~all) != -1)
+    fail("setaffinity with no existing CPU");
+  if(setaffinity(12345, all) != -1 || getaffinity(12345) != -1)
+    fail("an unknown thread");
+
+  // Pin the process on every CPU in turn.
+  for(i = 0; i < 32; i++){
+    mask = 1 << i;
+    if(!(all & mask))
+      continue;
+    if(setaffinity(-1, mask) != 0)
+      fail("setaffinity");
+    if(getaffinity(-1) != mask)
+      fail("getaffinity after pinning");
+    for(n = 0; n < 100; n++)
+      yield();
+    if(getaffinity(-1) != mask)
+      fail("getaffinity after yield");
+  }
+
+  // A new thread inherits the mask, and can be moved alone.
+  mask = 1 << (31 - __builtin_clz(all));
+  if(thread_create(&th, spinmain, 0) != 0)
+    fail("thread_create");
+  if(getaffinity(th) != mask)
+    fail("getaffinity of a new thread");
+  if(setaffinity(th, all) != 0)
+    fail("setaffinity of a thread");
+  if(getaffinity(th) != all || getaffinity(gettid()) != mask)
+    fail("getaffinity of a thread");
+  if(getaffinity(-1) != all)
+    fail("getaffinity of the process");
+  done = 1;
+  if(thread_join(th, &retval) != 0)
+    fail("thread_join");
+
+  if(setaffinity(-1, all) != 0 || getaffinity(-1) != all)
+    fail("setaffinity back to every CPU");
+
+  printf(1, "affinity test ok\n");
+  exit();
+}
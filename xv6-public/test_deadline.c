@@ -0,0 +1,94 @@
+#include "types.h"
+#include "user.h"
+
+// Test setdeadline: bad parameters, admission control and
+// throttling. Every deadline process takes ceil(runtime/deadline)
+// of the CPU out of the 100 tickets, and 20 of them are kept
+// for MLFQ. It assumes no other process reserved a share.
+
+int gpipe[2];
+
+void
+fail(char *msg)
+{
+  printf(1, "deadline test failed: %s\n", msg);
+  exit();
+}
+
+// Busy loop for n ticks, returns how many of them it ran in
+int
+spin(int n)
+{
+  int start = uptime();
+  int now, last = -1, ran = 0;
+
+  while((now = uptime()) < start + n){
+    if(now != last)
+      ran++;
+    last = now;
+  }
+  return ran;
+}
+
+int
+main(void)
+{
+  int pid, ret;
+
+  printf(1, "deadline test start\n");
+
+  if(setdeadline(0, 10, 10) != -1 ||
+     setdeadline(-1, 10, 10) != -1 ||
+     setdeadline(5, 4, 10) != -1 ||
+     setdeadline(5, 10, 8) != -1)
+    fail("bad parameters");
+  if(setdeadline(9, 10, 10) != -1)
+    fail("no reserve left for mlfq");
+  if(setdeadline(5, 6, 10) != -1)
+    fail("density over the free share");
+
+  if(setdeadline(5, 10, 10) != 0)
+    fail("setdeadline 50%");
+  spin(20);
+
+  if(pipe(gpipe) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(gpipe[0]);
+    // The child isn't a deadline process, and 50% remain.
+    ret = 0;
+    if(setdeadline(5, 10, 10) != -1)
+      ret = -1;
+    if(setdeadline(3, 10, 10) != 0)
+      ret = -1;
+    spin(20);
+    write(gpipe[1], (char*)&ret, sizeof(ret));
+    exit();
+  }
+  close(gpipe[1]);
+  if(read(gpipe[0], (char*)&ret, sizeof(ret)) != sizeof(ret) || ret != 0)
+    fail("overcommitted set was admitted");
+  close(gpipe[0]);
+  if(wait() != pid)
+    fail("wait");
+
+  // The share of the child is back, and its own counts again.
+  if(setdeadline(8, 10, 10) != 0)
+    fail("setdeadline 80%");
+  if(setdeadline(9, 10, 10) != -1)
+    fail("setdeadline 90%");
+  spin(20);
+
+  // 2 ticks in every 10 and a tick or so at the period edges,
+  // far from all 100 ticks it would see unthrottled.
+  if(setdeadline(2, 10, 10) != 0)
+    fail("setdeadline 20%");
+  ret = spin(100);
+  if(ret == 0 || ret > 50)
+    fail("runs past its budget");
+
+  printf(1, "deadline test ok\n");
+  exit();
+}
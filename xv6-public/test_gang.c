@@ -0,0 +1,96 @@
+#include "types.h"
+#include "user.h"
+
+// Test setgang: every thread of a gang process keeps running,
+// including when some of them sleep, and it can be turned off.
+
+#define NUM_THREAD 4
+
+volatile int done;
+volatile int cnt[NUM_THREAD];
+
+void
+fail(char *msg)
+{
+  printf(1, "gang test failed: %s\n", msg);
+  exit();
+}
+
+void*
+spinmain(void *arg)
+{
+  int i = (int)arg;
+
+  while(!done)
+    cnt[i]++;
+  thread_exit(0);
+  return 0;
+}
+
+void*
+sleepmain(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 5; i++)
+    sleep(2);
+  thread_exit(0);
+  return 0;
+}
+
+// Run the threads for a while and check all of them ran.
+int
+run(void)
+{
+  thread_t threads[NUM_THREAD], sleeper;
+  void *retval;
+  int i;
+
+  done = 0;
+  for(i = 0; i < NUM_THREAD; i++){
+    cnt[i] = 0;
+    if(thread_create(&threads[i], spinmain, (void*)i) != 0)
+      return -1;
+  }
+  if(thread_create(&sleeper, sleepmain, 0) != 0)
+    return -1;
+  if(thread_join(sleeper, &retval) != 0)
+    return -1;
+  sleep(10);
+  done = 1;
+  for(i = 0; i < NUM_THREAD; i++)
+    if(thread_join(threads[i], &retval) != 0)
+      return -1;
+  for(i = 0; i < NUM_THREAD; i++)
+    if(cnt[i] == 0)
+      return -1;
+  return 0;
+}
+
+int
+main(void)
+{
+  int pid;
+
+  printf(1, "gang test start\n");
+
+  if(setgang(1) != 0)
+    fail("setgang on");
+  if(run() != 0)
+    fail("threads of a gang");
+
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0)
+    exit();
+  if(wait() != pid)
+    fail("wait");
+
+  if(setgang(0) != 0)
+    fail("setgang off");
+  if(run() != 0)
+    fail("threads after gang");
+
+  printf(1, "gang test ok\n");
+  exit();
+}
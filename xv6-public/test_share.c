@@ -0,0 +1,87 @@
+#include "types.h"
+#include "user.h"
+
+// Test set_thread_share and set_group_share.
+// The process is pinned to one CPU, so its threads split the
+// CPU time by the weights of their groups and their own.
+
+#define NUM_THREAD 4
+
+volatile int start;
+volatile int done;
+volatile int cnt[NUM_THREAD];
+
+void
+fail(char *msg)
+{
+  printf(1, "share test failed: %s\n", msg);
+  exit();
+}
+
+void*
+countmain(void *arg)
+{
+  int i = (int)arg;
+
+  while(!start)
+    yield();
+  while(!done)
+    cnt[i]++;
+  thread_exit(0);
+  return 0;
+}
+
+int
+main(void)
+{
+  thread_t threads[NUM_THREAD];
+  void *retval;
+  int i;
+
+  printf(1, "share test start\n");
+  if(setaffinity(-1, 1) < 0)
+    fail("setaffinity");
+
+  if(set_thread_share(gettid(), -1, 1) != -1 ||
+     set_thread_share(gettid(), 4, 1) != -1 ||
+     set_thread_share(gettid(), 0, 0) != -1 ||
+     set_thread_share(gettid(), 0, 1001) != -1 ||
+     set_thread_share(12345, 0, 1) != -1)
+    fail("set_thread_share with bad arguments");
+  if(set_group_share(-1, 1) != -1 ||
+     set_group_share(4, 1) != -1 ||
+     set_group_share(0, 0) != -1 ||
+     set_group_share(0, 1001) != -1)
+    fail("set_group_share with bad arguments");
+
+  start = done = 0;
+  for(i = 0; i < NUM_THREAD; i++)
+    if(thread_create(&threads[i], countmain, (void*)i) != 0)
+      fail("thread_create");
+
+  // Group 1 gets 3/4 of the CPU, and thread 0 gets 3/4 of group 0.
+  if(set_group_share(0, 1) != 0 || set_group_share(1, 3) != 0)
+    fail("set_group_share");
+  if(set_thread_share(threads[0], 0, 3) != 0 ||
+     set_thread_share(threads[1], 0, 1) != 0 ||
+     set_thread_share(threads[2], 1, 1) != 0 ||
+     set_thread_share(threads[3], 1, 1) != 0)
+    fail("set_thread_share");
+
+  start = 1;
+  sleep(200);
+  done = 1;
+  for(i = 0; i < NUM_THREAD; i++)
+    if(thread_join(threads[i], &retval) != 0)
+      fail("thread_join");
+
+  for(i = 0; i < NUM_THREAD; i++)
+    printf(1, "thread %d: %d\n", i, cnt[i]);
+  if(cnt[1] == 0 || cnt[0] <= cnt[1])
+    fail("thread weights in a group");
+  if(cnt[0] + cnt[1] >= cnt[2] + cnt[3])
+    fail("group weights");
+
+  printf(1, "share test ok\n");
+  exit();
+}
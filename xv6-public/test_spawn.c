@@ -0,0 +1,57 @@
+#include "types.h"
+#include "user.h"
+
+// Test spawn with redirected fds and with bad arguments.
+
+void
+fail(char *msg)
+{
+  printf(1, "spawn test failed: %s\n", msg);
+  exit();
+}
+
+int
+main(void)
+{
+  char *argv[] = {"echo", "spawn", "ok", 0};
+  char buf[32];
+  int fds[3];
+  int p[2];
+  int pid, n, m, sv;
+
+  printf(1, "spawn test start\n");
+
+  if(spawn("nonexistent", argv, 0) != -1)
+    fail("spawn of a bad path");
+  fds[0] = -1;
+  fds[1] = 15;
+  fds[2] = -1;
+  if(spawn("echo", argv, fds) != -1)
+    fail("spawn with a closed fd");
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  fds[1] = p[1];
+  // A closed fd to inherit just stays closed in the child.
+  sv = dup(0);
+  close(0);
+  pid = spawn("echo", argv, fds);
+  if(dup(sv) != 0)
+    fail("dup");
+  close(sv);
+  if(pid < 0)
+    fail("spawn with fd 0 closed");
+  close(p[1]);
+  n = 0;
+  while(n < sizeof(buf) - 1 && (m = read(p[0], buf + n, sizeof(buf) - 1 - n)) > 0)
+    n += m;
+  buf[n] = 0;
+  close(p[0]);
+  if(wait() != pid)
+    fail("wait");
+  if(strcmp(buf, "spawn ok\n") != 0)
+    fail("output of the child");
+
+  printf(1, "spawn test ok\n");
+  exit();
+}
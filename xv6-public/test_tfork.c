@@ -0,0 +1,108 @@
+#include "types.h"
+#include "user.h"
+
+// Test tfork: the child gets a copy of the calling thread only,
+// which becomes its main thread.
+
+volatile int done;
+int val;
+int gpipe[2];
+thread_t other;
+
+void
+fail(char *msg)
+{
+  printf(1, "tfork test failed: %s\n", msg);
+  exit();
+}
+
+void*
+nopmain(void *arg)
+{
+  thread_exit(arg);
+  return 0;
+}
+
+void*
+spinmain(void *arg)
+{
+  while(!done)
+    ;
+  thread_exit(0);
+  return 0;
+}
+
+// Runs in the child, returns 0 if it looks right.
+int
+childcheck(void)
+{
+  thread_t th;
+  void *retval;
+
+  if(gettid() != 0)
+    return -1;
+  if(val != 1)
+    return -1;
+  // The other threads of the parent aren't copied.
+  if(thread_join(other, &retval) != -1)
+    return -1;
+  val = 2;
+  if(thread_create(&th, nopmain, (void*)7) != 0)
+    return -1;
+  if(thread_join(th, &retval) != 0 || (int)retval != 7)
+    return -1;
+  return 0;
+}
+
+void*
+forkmain(void *arg)
+{
+  int pid, ret;
+
+  if((pid = tfork()) < 0){
+    printf(1, "tfork test failed: tfork\n");
+    thread_exit((void*)-1);
+  }
+  if(pid == 0){
+    close(gpipe[0]);
+    ret = childcheck();
+    write(gpipe[1], (char*)&ret, sizeof(ret));
+    exit();
+  }
+  close(gpipe[1]);
+  ret = -1;
+  if(read(gpipe[0], (char*)&ret, sizeof(ret)) != sizeof(ret) ||
+     wait() != pid)
+    ret = -1;
+  close(gpipe[0]);
+  thread_exit((void*)ret);
+  return 0;
+}
+
+int
+main(void)
+{
+  thread_t th;
+  void *retval;
+
+  printf(1, "tfork test start\n");
+  val = 1;
+  if(pipe(gpipe) < 0)
+    fail("pipe");
+  if(thread_create(&other, spinmain, 0) != 0)
+    fail("thread_create");
+  if(thread_create(&th, forkmain, 0) != 0)
+    fail("thread_create");
+  if(thread_join(th, &retval) != 0)
+    fail("thread_join");
+  if((int)retval != 0)
+    fail("child");
+  if(val != 1)
+    fail("child wrote to the memory of the parent");
+  done = 1;
+  if(thread_join(other, &retval) != 0)
+    fail("thread_join");
+
+  printf(1, "tfork test ok\n");
+  exit();
+}
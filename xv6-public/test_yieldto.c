@@ -0,0 +1,93 @@
+#include "types.h"
+#include "user.h"
+
+// Test yield_to and futex_handoff.
+// The process is pinned to one CPU, so a thread given the CPU
+// must have run by the time the call returns.
+
+volatile int ran;
+volatile int done;
+thread_t owner;
+
+void
+fail(char *msg)
+{
+  printf(1, "yieldto test failed: %s\n", msg);
+  exit();
+}
+
+void*
+spinmain(void *arg)
+{
+  ran = 1;
+  while(!done)
+    ;
+  thread_exit(0);
+  return 0;
+}
+
+void*
+waitmain(void *arg)
+{
+  thread_t me = gettid();
+
+  owner = me;
+  while(owner == me)
+    futex_wait(&owner, me);
+  ran = 1;
+  while(!done)
+    ;
+  thread_exit(0);
+  return 0;
+}
+
+int
+main(void)
+{
+  thread_t th;
+  void *retval;
+
+  printf(1, "yieldto test start\n");
+  if(setaffinity(-1, 1) < 0)
+    fail("setaffinity");
+
+  if(yield_to(gettid()) != -1)
+    fail("yield_to itself");
+  if(yield_to(12345) != -1)
+    fail("yield_to an unknown thread");
+
+  ran = done = 0;
+  if(thread_create(&th, spinmain, 0) != 0)
+    fail("thread_create");
+  if(yield_to(th) != 0)
+    fail("yield_to a runnable thread");
+  if(!ran)
+    fail("yield_to returned before the thread ran");
+  done = 1;
+  if(thread_join(th, &retval) != 0)
+    fail("thread_join");
+  if(yield_to(th) != -1)
+    fail("yield_to an exited thread");
+
+  th = 12345;
+  if(futex_handoff(&th) != -1)
+    fail("futex_handoff to an unknown thread");
+
+  ran = done = 0;
+  owner = 0;
+  if(thread_create(&th, waitmain, 0) != 0)
+    fail("thread_create");
+  while(owner != th)
+    yield();
+  owner = 0;
+  if(futex_handoff(&th) != 0)
+    fail("futex_handoff");
+  if(!ran)
+    fail("futex_handoff returned before the waiter ran");
+  done = 1;
+  if(thread_join(th, &retval) != 0)
+    fail("thread_join");
+
+  printf(1, "yieldto test ok\n");
+  exit();
+}
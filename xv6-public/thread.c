@@ -95,12 +95,6 @@ threads_apply1(struct proc* p,
 
 ////////////
 
-static struct proc*
-__routine_get_thread(struct proc* th, void* tid)
-{
-  return th->tid == (thread_t)tid ? th : 0;
-}
-
 static struct proc*
 __routine_handle_orphan_thread(struct proc* th, void* main)
 {
@@ -111,44 +105,93 @@ __routine_handle_orphan_thread(struct proc* th, void* main)
 }
 
 static struct proc*
-__routine_is_ready(struct proc* th)
+__routine_kill_thread(struct proc* th)
 {
-  return th->state == RUNNABLE ? th : 0;
+  th->killed = 1;
+  return 0;
 }
 
 static struct proc*
-__routine_is_sleeping(struct proc* th)
+__routine_usurp_proc(struct proc *th, void *main)
 {
-  return th->state == SLEEPING ? th : 0;
+  th->thmain = (struct proc*)main;
+  th->leader = (struct proc*)main;
+  return 0;
 }
 
-static struct proc*
-__routine_is_ready_or_running(struct proc* th)
+////////////
+
+/* Function: hash_thread
+ * ------------------------
+ * @group      Thread
+ * @brief      Add a thread to the thread index.
+ * @note       The pid and the tid must be set.
+ *             ptable.lock must be held.
+ * @param[in]  th: thread to index
+ */
+void
+hash_thread(struct proc *th)
 {
-  return th->state == RUNNABLE || th->state == RUNNING ? th : 0;
+  list_add(&th->tidlink, &ptable.tidhash[TIDHASH(th->pid, th->tid)]);
 }
 
-static struct proc*
-__routine_kill_thread(struct proc* th)
+void
+unhash_thread(struct proc *th)
 {
-  th->killed = 1;
-  return 0;
+  list_del(&th->tidlink);
 }
 
-static struct proc*
-__routine_usurp_proc(struct proc *th, void *main)
+/* Function: lookup_thread
+ * ------------------------
+ * @group      Thread
+ * @brief      Find a thread by its pid and tid.
+ * @note       ptable.lock must be held.
+ * @param[in]  pid: process identifier
+ * @param[in]  thread: thread identifier
+ * @return     Thread or 0
+ */
+struct proc*
+lookup_thread(int pid, thread_t thread)
 {
-  th->thmain = (struct proc*)main;
+  struct list_head *q, *itr;
+  struct proc *th;
+
+  if(pid <= 0)
+    return 0;
+  q = &ptable.tidhash[TIDHASH(pid, thread)];
+  for(itr = q->next; itr != q; itr = itr->next){
+    th = list_entry(itr, struct proc, tidlink);
+    if(th->pid == pid && th->tid == thread)
+      return th;
+  }
   return 0;
 }
 
-////////////
-
 struct proc*
 get_thread(struct proc* p, thread_t thread)
 {
-  return threads_apply1(p, __routine_get_thread,
-                        (void*)thread);
+  return lookup_thread(p->pid, thread);
+}
+
+/* Function: find_thread
+ * ------------------------
+ * @group      Thread
+ * @brief      Find a thread of the current process by its tid
+ *             without holding ptable.lock.
+ * @note       The thread may exit once the lock is released,
+ *             so the caller must tolerate a stale thread.
+ * @param[in]  thread: thread identifier
+ * @return     Thread or 0
+ */
+struct proc*
+find_thread(thread_t thread)
+{
+  struct proc *th;
+
+  acquire(&ptable.lock);
+  th = get_thread(myproc(), thread);
+  release(&ptable.lock);
+  return th;
 }
 
 static void
@@ -157,6 +200,7 @@ __free_thread(struct proc *th)
   kfree(th->kstack);
   th->kstack = 0;
   deallocustack(th->pgdir, th->ustack);
+  unhash_thread(th);
   th->pid = 0;
   th->tid = 0;
   th->type = 0;
@@ -165,9 +209,13 @@ __free_thread(struct proc *th)
   th->killed = 0;
   th->tickets = 0;
   th->pass = 0;
+  th->vruntime = 0;
+  th->weight = FAIR_WEIGHT;
   th->ticks = 0;
   th->privlevel = 0;
   th->retval = 0;
+  th->cpumask = CPUMASK_ALL;
+  th->last_cpu = -1;
   th->state = UNUSED;
   nproc++;
   list_add(&th->free, &ptable.free);
@@ -178,20 +226,56 @@ __usurp_proc(struct proc *th)
 {
   int i;
   struct proc *thmain = main_thread(th);
+  struct rq *rq = thmain->rq;
+  struct sched_class *cl = sched_class(thmain);
 
+  // Leave the class with the old main thread and come back
+  // with the new one, which takes over the ready queue.
+  cl->detach(rq, thmain);
   th->sz = thmain->sz;
+  th->type = thmain->type;
   th->ticks = thmain->ticks;
+  th->privlevel = thmain->privlevel;
+  th->epoch = thmain->epoch;
+  for(i = 0; i < NTGROUP; i++){
+    th->tgroups[i].weight = thmain->tgroups[i].weight;
+    th->tgroups[i].pass = thmain->tgroups[i].pass;
+    if(list_empty(&thmain->tgroups[i].readyq))
+      list_head_init(&th->tgroups[i].readyq);
+    else
+      list_replace(&thmain->tgroups[i].readyq, &th->tgroups[i].readyq);
+    list_head_init(&thmain->tgroups[i].readyq);
+  }
+  th->tshares = thmain->tshares;
+  th->tickets = thmain->tickets;
+  th->pass = thmain->pass;
+  th->vruntime = thmain->vruntime;
+  th->weight = thmain->weight;
+  th->rq = rq;
+  th->nready = thmain->nready;
+  if(list_empty(&thmain->readyq))
+    list_head_init(&th->readyq);
+  else
+    list_replace(&thmain->readyq, &th->readyq);
+  list_head_init(&thmain->readyq);
+  thmain->nready = 0;
+  if(list_empty(&thmain->runq))
+    list_head_init(&th->runq);
+  else
+    list_replace(&thmain->runq, &th->runq);
+  list_head_init(&thmain->runq);
   for(i = 0; i < NOFILE; i++)
     if(thmain->ofile[i])
       th->ofile[i] = thmain->ofile[i];
   th->cwd = thmain->cwd;
-  if(th->type == STRIDE){
-    th->tickets = thmain->tickets;
-    th->pass = thmain->pass;
-  }
   threads_apply1(th, __routine_usurp_proc, th);
+  cl->attach(rq, th);
+  unhash_thread(thmain);
+  unhash_thread(th);
   thmain->tid = th->tid;
   th->tid = 0;
+  hash_thread(thmain);
+  hash_thread(th);
 }
 
 //////////
@@ -199,27 +283,190 @@ __usurp_proc(struct proc *th)
 struct proc*
 main_thread(struct proc *th)
 {
-  while(th != th->thmain)
-    th = th->thmain;
-  return th;
+  return th->leader;
 }
 
 struct proc*
 ready_thread(struct proc *th)
 {
-  return threads_apply0(th, __routine_is_ready);
+  struct proc *thmain = main_thread(th);
+
+  if(list_empty(&thmain->readyq))
+    return 0;
+  return list_first_entry(&thmain->readyq, struct proc, ready);
+}
+
+// The first thread of a group queue allowed on the cpu.
+static struct proc*
+group_first_on(struct tgroup *g, int cpu)
+{
+  struct list_head *itr;
+  struct proc *p;
+
+  for(itr = g->readyq.next; itr != &g->readyq; itr = itr->next){
+    p = list_entry(itr, struct proc, gready);
+    if(CPU_ALLOWED(p, cpu))
+      return p;
+  }
+  return 0;
+}
+
+/* Function: ready_thread_on
+ * ------------------------
+ * @group      Thread
+ * @brief      Get the RUNNABLE thread to run next on a cpu
+ *             according to the thread shares of the process.
+ * @note1      Until shares are set, every thread has the same
+ *             share and the ready queue order is kept.
+ * @note2      Else the thread group with the smaller pass goes
+ *             first, and in it the queue is kept by tpass.
+ *             Only the heads are looked at unless the cpu
+ *             isn't allowed, so it stays O(NTGROUP).
+ * @param[in]  th: any thread of the process
+ * @param[in]  cpu: cpu id
+ * @return     RUNNABLE thread or 0
+ */
+struct proc*
+ready_thread_on(struct proc *th, int cpu)
+{
+  struct proc *thmain = main_thread(th);
+  struct list_head *itr;
+  struct proc *p, *min = 0;
+  int i;
+
+  if(!thmain->tshares){
+    for(itr = thmain->readyq.next; itr != &thmain->readyq; itr = itr->next){
+      p = list_entry(itr, struct proc, ready);
+      if(CPU_ALLOWED(p, cpu))
+        return p;
+    }
+    return 0;
+  }
+  for(i = 0; i < NTGROUP; i++){
+    if(min != 0 &&
+       thmain->tgroups[i].pass >= thmain->tgroups[min->tgroup].pass)
+      continue;
+    if((p = group_first_on(&thmain->tgroups[i], cpu)) != 0)
+      min = p;
+  }
+  return min;
+}
+
+// Put a thread in the queue of its group by tpass. A thread
+// charged last has the largest tpass, so look from the tail.
+static void
+group_insert(struct tgroup *g, struct proc *th)
+{
+  struct list_head *itr;
+
+  for(itr = g->readyq.prev; itr != &g->readyq; itr = itr->prev)
+    if(list_entry(itr, struct proc, gready)->tpass <= th->tpass)
+      break;
+  list_add(&th->gready, itr);
+}
+
+/* Function: share_enqueue
+ * ------------------------
+ * @group      Thread
+ * @brief      Catch up the passes of a thread becoming RUNNABLE
+ *             and put it in the queue of its group.
+ * @note1      Like stride processes, a thread or a thread group
+ *             can't bank the time it slept. The thread catches up
+ *             with the ready threads of its group, and a group
+ *             without ready threads with the other groups.
+ *             The minimums are the heads of the group queues.
+ * @note2      It must be called before th joins the ready queue.
+ *             Nothing is done until shares are set.
+ * @param[in]  th: thread becoming RUNNABLE
+ */
+void
+share_enqueue(struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+  struct tgroup *g = &thmain->tgroups[th->tgroup];
+  uint64 tmin, gmin = MAXPASS;
+  int i;
+
+  if(!thmain->tshares)
+    return;
+  if(!list_empty(&g->readyq)){
+    tmin = list_first_entry(&g->readyq, struct proc, gready)->tpass;
+    if(th->tpass < tmin)
+      th->tpass = tmin;
+  } else {
+    for(i = 0; i < NTGROUP; i++)
+      if(!list_empty(&thmain->tgroups[i].readyq) &&
+         thmain->tgroups[i].pass < gmin)
+        gmin = thmain->tgroups[i].pass;
+    if(gmin != MAXPASS && g->pass < gmin)
+      g->pass = gmin;
+  }
+  group_insert(g, th);
+}
+
+// Take a RUNNABLE thread out of the queue of its group.
+void
+share_dequeue(struct proc *th)
+{
+  if(main_thread(th)->tshares)
+    list_del(&th->gready);
+}
+
+/* Function: share_start
+ * ------------------------
+ * @group      Thread
+ * @brief      Queue the ready threads of a process by their
+ *             groups, the first time its shares are set.
+ * @param[in]  thmain: main thread of the process, with the
+ *                     run queue locked
+ */
+static void
+share_start(struct proc *thmain)
+{
+  struct list_head *itr;
+
+  if(thmain->tshares)
+    return;
+  thmain->tshares = 1;
+  for(itr = thmain->readyq.next; itr != &thmain->readyq; itr = itr->next)
+    share_enqueue(list_entry(itr, struct proc, ready));
+}
+
+/* Function: share_charge
+ * ------------------------
+ * @group      Thread
+ * @brief      Charge a thread and its group for a run.
+ * @note       The process itself is charged by its class.
+ * @param[in]  th: thread leaving the cpu
+ */
+void
+share_charge(struct proc *th)
+{
+  struct proc *thmain = main_thread(th);
+  struct tgroup *g = &thmain->tgroups[th->tgroup];
+
+  th->tpass += STRD(th->tweight);
+  g->pass += STRD(g->weight);
 }
 
 struct proc*
-sleeping_thread(struct proc *th)
+running_thread(struct proc *th)
 {
-  return threads_apply0(th, __routine_is_sleeping);
+  struct proc *thmain = main_thread(th);
+
+  if(list_empty(&thmain->runq))
+    return 0;
+  return list_first_entry(&thmain->runq, struct proc, run);
 }
 
 struct proc*
 ready_or_running_thread(struct proc *th)
 {
-  return threads_apply0(th, __routine_is_ready_or_running);
+  struct proc *p;
+
+  if((p = ready_thread(th)) != 0)
+    return p;
+  return running_thread(th);
 }
 
 int
@@ -247,12 +494,15 @@ int
 monopolize_proc(struct proc *p)
 {
   struct proc *th;
+  struct rq *rq;
   int null = 0;
 
   acquire(&ptable.lock);
   if(p != p->thmain){
     wakeup1(p->thmain);
+    rq = rq_lock_proc(p);
     __usurp_proc(p);
+    release(&rq->lock);
   }
   terminate_proc(p);
   p->killed = 0;
@@ -286,6 +536,7 @@ thread_create(thread_t *thread,
 {
   uint sp;
   struct proc *nth, *curth, *thmain, *thlast;
+  struct rq *rq;
 
   acquire(&ptable.lock);
 
@@ -293,6 +544,15 @@ thread_create(thread_t *thread,
   thmain = main_thread(curth);
   thlast = list_last_entry(&thmain->thgroup, struct proc, thgroup);
 
+  // The new stack and its guard page go below the lowest one,
+  // and must stay above the heap, which is mapped lazily
+  // (see growproc).
+  sp = PGROUNDDOWN(thlast->ustack) - PGSIZE;
+  if(sp < USTACKSIZE + PGSIZE || sp - USTACKSIZE - PGSIZE < thmain->sz){
+    release(&ptable.lock);
+    return -1;
+  }
+
   // Allocate process.
   if((nth = allocproc()) == 0){
     release(&ptable.lock);
@@ -305,9 +565,10 @@ thread_create(thread_t *thread,
   nth->parent = thmain->parent;
   list_add_tail(&nth->sibling, &thmain->parent->children);
   nth->type = thmain->type;
+  nth->cpumask = curth->cpumask;
+  nth->tgroup = curth->tgroup;
 
   // Set user stack
-  sp = PGROUNDDOWN(thlast->ustack) - PGSIZE;
   if(allocustack(nth->pgdir, sp - USTACKSIZE) == 0){
     kfree(nth->kstack);
     nth->kstack = 0;
@@ -327,7 +588,9 @@ thread_create(thread_t *thread,
   // Set thread
   nth->tid = thlast->tid + 1;
   nth->thmain = curth;
+  nth->leader = thmain;
   list_add_tail(&nth->thgroup, &thmain->thgroup);
+  hash_thread(nth);
   *thread = nth->tid;
 
   // Set trapframe
@@ -338,10 +601,11 @@ thread_create(thread_t *thread,
 
   safestrcpy(nth->name, thmain->name, sizeof(thmain->name));
 
+  rq = rq_lock_proc(nth);
   nth->state = RUNNABLE;
-  if(nth->type == MLFQ)
-    enqueue_thread(nth);
-  invalidate_tlb(curth);
+  enqueue_thread(nth);
+  release(&rq->lock);
+  kick_idle(rq, nth);
 
   release(&ptable.lock);
 
@@ -388,10 +652,9 @@ thread_exit(void *retval)
   }
   list_bulk_move_tail(&curth->children, &main_thread(curth)->children);
 
-
-  if(curth->type == MLFQ)
-    dequeue_thread(curth);
+  rq_lock_proc(curth);
   curth->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie thread exit");
 }
@@ -421,6 +684,7 @@ thread_join(thread_t thread, void **retval)
     }
     if(th->state == ZOMBIE && th->thmain == curth){
       *retval = th->retval;
+      rq_barrier(th);
       list_del(&th->thgroup);
       list_del(&th->sibling);
       __free_thread(th);
@@ -430,3 +694,70 @@ thread_join(thread_t thread, void **retval)
     sleep(curth, &ptable.lock);
   }
 }
+
+/* Function: set_thread_share
+ * ------------------------
+ * @group      Thread
+ * @brief      Put a thread in a thread group with a weight.
+ * @note       The share of the process is divided among its
+ *             thread groups by their weights, and the share of
+ *             a group among its threads by their weights.
+ * @param[in]  thread: thread of the current process
+ * @param[in]  group: thread group (0 ~ NTGROUP-1)
+ * @param[in]  weight: weight in the group (1 ~ LARGENUM)
+ * @return     On success 0 and on error -1
+ */
+int
+set_thread_share(thread_t thread, int group, int weight)
+{
+  struct proc *th;
+  struct rq *rq;
+
+  if(group < 0 || group >= NTGROUP || weight < 1 || weight > LARGENUM)
+    return -1;
+
+  acquire(&ptable.lock);
+  if((th = get_thread(myproc(), thread)) == 0){
+    release(&ptable.lock);
+    return -1;
+  }
+  rq = rq_lock_proc(th);
+  share_start(main_thread(th));
+  if(th->state == RUNNABLE){
+    share_dequeue(th);
+    th->tgroup = group;
+    share_enqueue(th);
+  } else
+    th->tgroup = group;
+  th->tweight = weight;
+  release(&rq->lock);
+  release(&ptable.lock);
+  return 0;
+}
+
+/* Function: set_group_share
+ * ------------------------
+ * @group      Thread
+ * @brief      Set the weight of a thread group of the current process.
+ * @param[in]  group: thread group (0 ~ NTGROUP-1)
+ * @param[in]  weight: weight in the process (1 ~ LARGENUM)
+ * @return     On success 0 and on error -1
+ */
+int
+set_group_share(int group, int weight)
+{
+  struct proc *thmain;
+  struct rq *rq;
+
+  if(group < 0 || group >= NTGROUP || weight < 1 || weight > LARGENUM)
+    return -1;
+
+  acquire(&ptable.lock);
+  thmain = main_thread(myproc());
+  rq = rq_lock_proc(thmain);
+  share_start(thmain);
+  thmain->tgroups[group].weight = weight;
+  release(&rq->lock);
+  release(&ptable.lock);
+  return 0;
+}
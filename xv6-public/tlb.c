@@ -0,0 +1,147 @@
+// TLB shootdown.
+//
+// When a PTE of a user page table is weakened or removed, every
+// CPU with that page table loaded may still hold the old entry
+// in its TLB. The initiator flushes its own TLB and sends an
+// IPI only to those CPUs, then waits until all of them
+// acknowledged.
+// A request carries a batch of addresses to invlpg one by one,
+// and a larger range is flushed as a whole by reloading cr3.
+// A cpu which only keeps the page table loaded since its
+// process stopped running switches to the kernel one instead.
+//
+// A target may be spinning on a lock with interrupts disabled,
+// and the lock may be held by the initiator, so acquire() also
+// serves a pending request while it spins (see tlbpoll).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "traps.h"
+#include "list.h"
+#include "proc.h"
+#include "spinlock.h"
+
+struct {
+  struct spinlock lock;   // one request at a time
+  pde_t *pgdir;
+  int n;                  // number of va, or -1 to flush all
+  uint va[NTLBBATCH];
+  volatile uint pending;  // bitmask of cpus yet to flush
+} shootdown;
+
+void
+tlbinit(void)
+{
+  initlock(&shootdown.lock, "shootdown");
+}
+
+/* Function: flush_local
+ * ------------------------
+ * @group      VM
+ * @brief      Flush the TLB entries of this cpu for a page table.
+ * @note       Nothing is flushed unless pgdir is loaded. If no
+ *             thread of it is running, the cpu leaves it instead,
+ *             so it may be freed.
+ * @param[in]  pgdir: page table whose PTEs changed
+ * @param[in]  va: user virtual addresses to invalidate
+ * @param[in]  n: number of va, or -1 to flush the whole TLB
+ */
+static void
+flush_local(pde_t *pgdir, uint *va, int n)
+{
+  struct cpu *c = mycpu();
+  int i;
+
+  if(c->pgdir != pgdir)
+    return;
+  if(c->proc == 0 || c->proc->pgdir != pgdir){
+    switchkvm();
+    c->pgdir = 0;
+    return;
+  }
+  if(n < 0)
+    lcr3(V2P(pgdir));
+  else
+    for(i = 0; i < n; i++)
+      invlpg((void*)va[i]);
+}
+
+/* Function: tlbpoll
+ * ------------------------
+ * @group      VM
+ * @brief      Serve a shootdown request sent to this cpu.
+ * @note       It is called from the shootdown IPI and while
+ *             spinning on a lock with interrupts disabled.
+ */
+void
+tlbpoll(void)
+{
+  uint bit;
+
+  if(shootdown.pending == 0)
+    return;
+  bit = 1 << cpuid();
+  if(!(shootdown.pending & bit))
+    return;
+  flush_local(shootdown.pgdir, shootdown.va, shootdown.n);
+  __sync_fetch_and_and(&shootdown.pending, ~bit);
+}
+
+/* Function: tlbflush
+ * ------------------------
+ * @group      VM
+ * @brief      Invalidate stale TLB entries of a page table
+ *             on every cpu which has it loaded.
+ * @note1      It must be called after the PTEs are changed and
+ *             before the pages they mapped are reused.
+ *             New mappings need no flush.
+ * @note2      More than NTLBBATCH addresses are flushed as a
+ *             whole, like n = -1.
+ * @param[in]  pgdir: page table whose PTEs changed
+ * @param[in]  va: user virtual addresses to invalidate
+ * @param[in]  n: number of va, or -1 to flush the whole TLB
+ */
+void
+tlbflush(pde_t *pgdir, uint *va, int n)
+{
+  struct cpu *c, *self;
+  uint mask = 0;
+  int i;
+
+  if(n == 0)
+    return;
+  if(n > NTLBBATCH)
+    n = -1;
+  pushcli();
+  self = mycpu();
+  flush_local(pgdir, va, n);
+  // A cpu which switches to pgdir after this point
+  // loads cr3 after the PTEs are changed.
+  __sync_synchronize();
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c != self && c->pgdir == pgdir)
+      mask |= 1 << (c - cpus);
+  if(mask == 0){
+    popcli();
+    return;
+  }
+
+  acquire(&shootdown.lock);
+  shootdown.pgdir = pgdir;
+  shootdown.n = n;
+  for(i = 0; i < n; i++)
+    shootdown.va[i] = va[i];
+  __sync_synchronize();
+  shootdown.pending = mask;
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(mask & (1 << (c - cpus)))
+      lapicipi(c->apicid, T_IRQ0 + IRQ_TLB);
+  while(shootdown.pending != 0)
+    ;
+  release(&shootdown.lock);
+  popcli();
+}
@@ -0,0 +1,94 @@
+// Scheduler latency tracing.
+//
+// Every cpu records its events into its own ring buffer.
+// A ring has a single producer, its cpu with interrupts
+// disabled, so recording takes no lock: the producer only
+// writes head and the drainer only writes tail. If a ring
+// is full, new events are dropped until it is drained.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "list.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "trace.h"
+
+struct tracebuf {
+  struct trace_event ev[NTRACE];
+  volatile uint head;        // next slot to record
+  volatile uint tail;        // next slot to drain
+};
+
+static struct tracebuf tracebuf[NCPU];
+static struct spinlock tracelock;   // serializes drainers
+
+void
+traceinit(void)
+{
+  initlock(&tracelock, "trace");
+}
+
+/* Function: trace
+ * ------------------------
+ * @group      Trace
+ * @brief      Record a scheduler event of a thread
+ *             into the ring of the current cpu.
+ * @param[in]  type: TRACE_* event type
+ * @param[in]  th: thread of the event
+ */
+void
+trace(int type, struct proc *th)
+{
+  struct tracebuf *tb;
+  struct trace_event *e;
+  struct proc *thmain = main_thread(th);
+
+  pushcli();
+  tb = &tracebuf[cpuid()];
+  if(tb->head - tb->tail < NTRACE){
+    e = &tb->ev[tb->head % NTRACE];
+    e->tsc = rdtsc();
+    e->pass = thmain->pass;
+    e->pid = th->pid;
+    e->tid = th->tid;
+    e->type = type;
+    e->cpu = cpuid();
+    e->level = thmain->type == MLFQ ? getlev(thmain) : -thmain->type;
+    // Publish the event after it is written.
+    __sync_synchronize();
+    tb->head++;
+  }
+  popcli();
+}
+
+/* Function: trace_drain
+ * ------------------------
+ * @group      Trace
+ * @brief      Move recorded events out of the rings of all cpus.
+ * @note       Events are in order within a cpu, not across cpus.
+ * @param[out] buf: event buffer
+ * @param[in]  n: the maximum number of events
+ * @return     The number of drained events
+ */
+int
+trace_drain(struct trace_event *buf, int n)
+{
+  struct tracebuf *tb;
+  int cnt = 0;
+
+  acquire(&tracelock);
+  for(tb = tracebuf; tb < &tracebuf[ncpu]; tb++){
+    while(cnt < n && tb->tail != tb->head){
+      buf[cnt++] = tb->ev[tb->tail % NTRACE];
+      // Free the slot only after it is copied.
+      __sync_synchronize();
+      tb->tail++;
+    }
+  }
+  release(&tracelock);
+  return cnt;
+}
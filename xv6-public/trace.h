@@ -0,0 +1,18 @@
+// Scheduler trace events.
+// Shared by the kernel (trace.c) and user programs.
+#define TRACE_ENQUEUE   1    // became RUNNABLE
+#define TRACE_DISPATCH  2    // started RUNNING
+#define TRACE_PREEMPT   3    // gave up the cpu while RUNNABLE
+#define TRACE_SLEEP     4    // went SLEEPING
+
+#define NTRACE        512    // events per cpu ring (power of 2)
+
+struct trace_event {
+  uint64 tsc;                // time stamp counter
+  uint64 pass;               // stride pass of the process
+  int pid;
+  int tid;
+  uchar type;                // TRACE_*
+  uchar cpu;
+  short level;               // MLFQ level, or -1 stride, -2 fair, -3 deadline
+};
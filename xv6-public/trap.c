@@ -55,9 +55,22 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+    } else {
+      // One-shot: arm the next tick if still needed.
+      mycpu()->ticking = 0;
+      update_tick();
     }
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_RESCHED:
+    // Wakes the idle loop, or a tickless CPU to tick again.
+    update_tick();
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_TLB:
+    tlbpoll();
+    lapiceoi();
+    break;
   case T_IRQ0 + IRQ_IDE:
     ideintr();
     lapiceoi();
@@ -79,6 +92,10 @@ trap(struct trapframe *tf)
             cpuid(), tf->cs, tf->eip);
     lapiceoi();
     break;
+  case T_PGFLT:
+    if(pgfault(rcr2(), tf->err) == 0)
+      break;
+    // fall through
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -108,6 +125,10 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->state == RUNNING &&
      tf->trapno == T_IRQ0+IRQ_TIMER)
     yield();
+  // Or to a more urgent thread (see resched_rq).
+  else if(myproc() && myproc()->state == RUNNING &&
+          tf->trapno == T_IRQ0+IRQ_RESCHED && xchg(&mycpu()->resched, 0))
+    preempt();
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
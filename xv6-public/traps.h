@@ -34,5 +34,7 @@
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20      // IPI to kick an idle CPU
+#define IRQ_TLB         21      // IPI to flush stale TLB entries
 #define IRQ_SPURIOUS    31
 
@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct trace_event;
 
 // system calls
 int fork(void);
@@ -34,6 +35,18 @@ int futex_wait(thread_t*, thread_t);
 int futex_wake(thread_t*);
 int pread(int, void*, int, int);
 int pwrite(int, void*, int, int);
+int gettrace(struct trace_event*, int);
+int setsched(int, int);
+int setdeadline(int, int, int);
+int setgang(int);
+int tfork(void);
+int spawn(char*, char**, int*);
+int setaffinity(int, uint);
+int getaffinity(int);
+int yield_to(thread_t);
+int futex_handoff(thread_t*);
+int set_thread_share(thread_t, int, int);
+int set_group_share(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -6,13 +6,17 @@
 #include "mmu.h"
 #include "list.h"
 #include "proc.h"
+#include "spinlock.h"
 #include "elf.h"
 #include "thread.h"
 
 extern char data[];  // defined by kernel.ld
+// Serializes page faults with the copy-on-write sharing
+// of fork, which both change PTEs and references.
+struct spinlock vmlock;
 pde_t *kpgdir;  // for use in scheduler()
 
-// Set up CPU's kernel segment descriptors.
+// Set up CPU's kernel segment descriptors and its TSS.
 // Run once on entry on each CPU.
 void
 seginit(void)
@@ -28,12 +32,47 @@ seginit(void)
   c->gdt[SEG_KDATA] = SEG(STA_W, 0, 0xffffffff, 0);
   c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, DPL_USER);
   c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
+  c->gdt[SEG_TSS] = SEG16(STS_T32A, &c->ts, sizeof(c->ts)-1, 0);
+  c->gdt[SEG_TSS].s = 0;
   lgdt(c->gdt, sizeof(c->gdt));
+
+  // Only esp0 changes on a switch (see switchuvm).
+  c->ts.ss0 = SEG_KDATA << 3;
+  // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
+  // forbids I/O instructions (e.g., inb and outb) from user space
+  c->ts.iomb = (ushort) 0xFFFF;
+  ltr(SEG_TSS << 3);
+}
+
+// Split a large user page containing va into small pages,
+// which map the same memory with the same permissions.
+// Returns 0 if it is done or va isn't in a large page,
+// or -1 if out of memory.
+static int
+splitpde(pde_t *pgdir, const void *va)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+  int i;
+
+  pde = &pgdir[PDX(va)];
+  if((*pde & (PTE_P|PTE_PS)) != (PTE_P|PTE_PS))
+    return 0;
+  if((uint)va >= KERNBASE)
+    panic("splitpde");
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  for(i = 0; i < NPTENTRIES; i++)
+    pgtab[i] = (PTE_ADDR(*pde) + i*PGSIZE) | (PTE_FLAGS(*pde) & ~PTE_PS);
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
 }
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
+// A large page has no PTE, so the caller must split
+// it first (see splitpde).
 static pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
@@ -41,7 +80,9 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
-  if(*pde & PTE_P){
+  if((*pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS)){
+    panic("walkpgdir: large page");
+  } else if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
     if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
@@ -59,15 +100,32 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
+// With PTE_PS in perm, a large page is used wherever both va
+// and pa are aligned to it and the range covers it.
 static int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
+  pde_t *pde;
   pte_t *pte;
+  int large = perm & PTE_PS;
 
+  perm &= ~PTE_PS;
   a = (char*)PGROUNDDOWN((uint)va);
   last = (char*)PGROUNDDOWN(((uint)va) + size - 1);
   for(;;){
+    if(large && (uint)a % LPGSIZE == 0 && pa % LPGSIZE == 0 &&
+       (uint)last - (uint)a >= LPGSIZE - PGSIZE){
+      pde = &pgdir[PDX(a)];
+      if(*pde & PTE_P)
+        panic("remap");
+      *pde = pa | perm | PTE_PS | PTE_P;
+      if((uint)a + (LPGSIZE - PGSIZE) == (uint)last)
+        break;
+      a += LPGSIZE;
+      pa += LPGSIZE;
+      continue;
+    }
     if((pte = walkpgdir(pgdir, a, 1)) == 0)
       return -1;
     if(*pte & PTE_P)
@@ -112,8 +170,8 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
- { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
+ { (void*)data,     V2P(data),     PHYSTOP,   PTE_W|PTE_PS}, // kern data+memory
+ { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W|PTE_PS}, // more devices
 };
 
 // Set up kernel part of a page table.
@@ -142,6 +200,7 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  initlock(&vmlock, "vm");
   kpgdir = setupkvm();
   switchkvm();
 }
@@ -154,23 +213,23 @@ switchkvm(void)
   lcr3(V2P(kpgdir));   // switch to the kernel page table
 }
 
-// When xv6 changes the page tables, it must invalidate
-// the cache entries. If it doesn't invalidate the cache
-// entries, then at some point later the TLB might use
-// an old mapping, pointing to a physical page that in the
-// mean time has been allocated to another process.
-void
-invalidate_tlb(struct proc *p)
-{
-  pushcli();
-  lcr3(V2P(p->pgdir));
-  popcli();
-}
-
-// Switch TSS and h/w page table to correspond to process p.
+/* Function: switchuvm
+ * ------------------------
+ * @group      VM
+ * @brief      Switch TSS and h/w page table to correspond to
+ *             process p.
+ * @note       A cpu keeps the last user page table loaded after
+ *             the process stops running, so cr3 is written only if
+ *             the next thread doesn't share it. A shootdown makes
+ *             the cpu leave a page table it keeps this way
+ *             (see tlbflush).
+ * @param[in]  p: thread to run
+ */
 void
 switchuvm(struct proc *p)
 {
+  struct cpu *c;
+
   if(p == 0)
     panic("switchuvm: no process");
   if(p->kstack == 0)
@@ -179,24 +238,13 @@ switchuvm(struct proc *p)
     panic("switchuvm: no pgdir");
 
   pushcli();
-  mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
-                                sizeof(mycpu()->ts)-1, 0);
-  mycpu()->gdt[SEG_TSS].s = 0;
-  mycpu()->ts.ss0 = SEG_KDATA << 3;
-  mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
-  // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
-  // forbids I/O instructions (e.g., inb and outb) from user space
-  mycpu()->ts.iomb = (ushort) 0xFFFF;
-  ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));
-  popcli();
-}
-
-void
-vswitchuvm(struct proc *p)
-{
-  pushcli();
-  mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
+  c = mycpu();
+  c->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
+  if(c->pgdir != p->pgdir){
+    // Seen by tlbflush before the PTEs are read.
+    c->pgdir = p->pgdir;
+    lcr3(V2P(p->pgdir));
+  }
   popcli();
 }
 
@@ -271,33 +319,113 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
-// Deallocate user pages to bring the process size from oldsz to
-// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
-// need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
-int
-deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+/* Function: unmapuvm
+ * ------------------------
+ * @group      VM
+ * @brief      Clear PTE_P of the user pages from newsz to oldsz.
+ * @note1      The physical address stays in the entry,
+ *             so that freeuvm can free the page later.
+ * @note2      A large page inside the range is unmapped whole,
+ *             and the ones across its ends must be split.
+ * @param[in]  pgdir: page table
+ * @param[in]  oldsz: end of the range
+ * @param[in]  newsz: start of the range
+ * @param[out] va: the first NTLBBATCH unmapped addresses
+ * @return     Number of unmapped pages and large pages
+ */
+static int
+unmapuvm(pde_t *pgdir, uint oldsz, uint newsz, uint *va)
 {
+  pde_t *pde;
   pte_t *pte;
-  uint a, pa;
-
-  if(newsz >= oldsz)
-    return oldsz;
+  uint a;
+  int n = 0;
 
   a = PGROUNDUP(newsz);
-  for(; a  < oldsz; a += PGSIZE){
+  for(; a < oldsz; a += PGSIZE){
+    pde = &pgdir[PDX(a)];
+    if((*pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS) &&
+       a % LPGSIZE == 0 && a + (LPGSIZE - PGSIZE) < oldsz){
+      // A whole large page
+      *pde &= ~PTE_P;
+      if(n < NTLBBATCH)
+        va[n] = a;
+      n++;
+      a += LPGSIZE - PGSIZE;
+      continue;
+    }
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
     else if((*pte & PTE_P) != 0){
+      *pte &= ~PTE_P;
+      if(n < NTLBBATCH)
+        va[n] = a;
+      n++;
+    }
+  }
+  return n;
+}
+
+// Free the pages unmapped by unmapuvm and clear their entries.
+static void
+freeuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  pde_t *pde;
+  pte_t *pte;
+  uint a, pa;
+
+  a = PGROUNDUP(newsz);
+  for(; a < oldsz; a += PGSIZE){
+    pde = &pgdir[PDX(a)];
+    if((*pde & (PTE_P|PTE_PS)) == PTE_PS){
+      kfreelarge(P2V(PTE_ADDR(*pde)));
+      *pde = 0;
+      a += LPGSIZE - PGSIZE;
+      continue;
+    }
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(!pte)
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+    else if(*pte != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      kfree(P2V(pa));
       *pte = 0;
     }
   }
+}
+
+// Deallocate user pages to bring the process size from oldsz to
+// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
+// need to be less than oldsz.  oldsz can be larger than the actual
+// process size.  Returns the new process size, or -1 if a large
+// page across an end of the range can't be split.
+// Other threads may be using the page table on other cpus, so
+// the pages are freed only after their TLB entries are shot down.
+int
+deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  uint va[NTLBBATCH], first, last;
+  int n;
+
+  if(newsz >= oldsz)
+    return oldsz;
+
+  first = PGROUNDUP(newsz);
+  last = PGROUNDUP(oldsz) - PGSIZE;
+  acquire(&vmlock);
+  if(first <= last &&
+     ((first % LPGSIZE != 0 && splitpde(pgdir, (char*)first) < 0) ||
+      ((last + PGSIZE) % LPGSIZE != 0 && splitpde(pgdir, (char*)last) < 0))){
+    release(&vmlock);
+    return -1;
+  }
+  n = unmapuvm(pgdir, oldsz, newsz, va);
+  tlbflush(pgdir, va, n);
+  freeuvm(pgdir, oldsz, newsz);
+  release(&vmlock);
   return newsz;
 }
 
@@ -311,8 +439,11 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
+  // Make the cpus still keeping pgdir loaded leave it.
+  tlbflush(pgdir, 0, -1);
   for(i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
+    // Large pages of the kernel map aren't page tables.
+    if((pgdir[i] & (PTE_P|PTE_PS)) == PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -333,72 +464,201 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
-struct proc*
-__routine_copy_ustack(struct proc *th, void *d)
+struct copyarg {
+  pde_t *pgdir;
+  uint va[NTLBBATCH];  // pages made read-only in the parent
+  int n;
+};
+
+/* Function: copypage
+ * ------------------------
+ * @group      VM
+ * @brief      Share a user page of the parent with the child.
+ * @note       If it is writable, it becomes read-only
+ *             copy-on-write in both, and the first write
+ *             copies it (see pgfault).
+ * @param[in]  s: page table of the parent
+ * @param[in]  c: page table of the child and the pages
+ *                whose TLB entries the parent must flush
+ * @param[in]  va: user virtual address of the page
+ * @return     On success 0 and on error -1
+ */
+static int
+copypage(pde_t *s, struct copyarg *c, uint va)
 {
   pte_t *pte;
-  uint ustack, pa, i, flags;
-  char *mem;
-  pte_t *pgdir;
+  uint pa, flags;
+
+  if(splitpde(s, (void*)va) < 0)
+    return -1;
+  // Heap pages not touched yet are not mapped (see pgfault).
+  if((pte = walkpgdir(s, (void*)va, 0)) == 0 || !(*pte & PTE_P))
+    return 0;
+  pa = PTE_ADDR(*pte);
+  flags = PTE_FLAGS(*pte);
+  if(flags & PTE_W){
+    flags = (flags & ~PTE_W) | PTE_COW;
+    *pte = pa | flags;
+    if(c->n < NTLBBATCH)
+      c->va[c->n] = va;
+    c->n++;
+  }
+  if(mappages(c->pgdir, (void*)va, PGSIZE, pa, flags) < 0)
+    return -1;
+  kref(P2V(pa));
+  return 0;
+}
+
+struct proc*
+__routine_copy_ustack(struct proc *th, void *arg)
+{
+  struct copyarg *c = (struct copyarg*)arg;
+  uint ustack, i;
 
-  pgdir = (pte_t*)d;
   ustack = th->ustack;
-  for(i = PGROUNDDOWN(ustack) - PGSIZE; i < ustack + USTACKSIZE; i += PGSIZE){
-    if((pte = walkpgdir(th->pgdir, (void*)i, 0)) == 0)
-      panic("__routine_copy_ustack: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("__routine_copy_ustack: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+  for(i = PGROUNDDOWN(ustack) - PGSIZE; i < ustack + USTACKSIZE; i += PGSIZE)
+    if(copypage(th->pgdir, c, i) < 0)
       return th;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(pgdir, (void*)i, PGSIZE, V2P(mem), flags) < 0){
-      kfree(mem);
-      return th;
-    }
-  }
   return 0;
 }
+
+// Given a parent process's page table, create a copy
+// of it for a child, which shares the pages copy-on-write.
+// The user stacks of all threads are copied if all is set,
+// otherwise only the one of p. Other threads of p may be
+// running, so the pages made read-only are shot down.
 pde_t*
-copyuvm(struct proc *p)
+copyuvm(struct proc *p, int all)
 {
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
-  char *mem;
+  uint i, sz;
+  struct copyarg c;
 
   if((d = setupkvm()) == 0)
     return 0;
 
-  for(i = 0; i < p->sz; i += PGSIZE){
-    if((pte = walkpgdir(p->pgdir, (void*)i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
+  c.pgdir = d;
+  c.n = 0;
+  acquire(&vmlock);
+  sz = main_thread(p)->sz;
+  for(i = 0; i < sz; i += PGSIZE)
+    if(copypage(p->pgdir, &c, i) < 0)
       goto bad;
-    }
-  }
 
-  if(threads_apply1(p, __routine_copy_ustack, (void*)d) != 0)
+  if(all && threads_apply1(p, __routine_copy_ustack, (void*)&c) != 0)
+    goto bad;
+  if(!all && __routine_copy_ustack(p, (void*)&c) != 0)
     goto bad;
 
+  tlbflush(p->pgdir, c.va, c.n);
+  release(&vmlock);
   return d;
 
 bad:
+  tlbflush(p->pgdir, c.va, c.n);
+  release(&vmlock);
   freevm(d);
   return 0;
 }
 
+/* Function: pgfault
+ * ------------------------
+ * @group      VM
+ * @brief      Handle a page fault of the current process.
+ * @note1      The heap below sz is mapped on first touch, with
+ *             a zeroed page (see growproc). A large page is used
+ *             if its whole range is heap and none of it is mapped.
+ * @note2      A write to a copy-on-write page copies it, or
+ *             takes it over if no one else maps it any more.
+ * @note3      A page another thread already mapped or made
+ *             writable only needs to refresh the local TLB.
+ *             A copied page is shot down on the other cpus
+ *             before the old one is released.
+ * @note4      It also serves the kernel accessing user memory.
+ * @param[in]  va: faulting virtual address
+ * @param[in]  err: page fault error code
+ * @return     If the fault is handled 0 else -1
+ */
+int
+pgfault(uint va, uint err)
+{
+  struct proc *p = myproc();
+  pde_t *pde;
+  pte_t *pte;
+  uint pa, flags;
+  char *mem, *large = 0;
+
+  if(p == 0 || va >= KERNBASE)
+    return -1;
+
+  // Zero a large page before taking the lock.
+  pde = &p->pgdir[PDX(va)];
+  if(!(*pde & PTE_P) && LPGROUNDDOWN(va) + LPGSIZE <= main_thread(p)->sz &&
+     (large = kalloclarge()) != 0)
+    memset(large, 0, LPGSIZE);
+
+  acquire(&vmlock);
+  if(large){
+    if((*pde & PTE_P) || LPGROUNDDOWN(va) + LPGSIZE > main_thread(p)->sz){
+      // Another thread mapped the range or growproc shrank
+      // the heap meanwhile, so just retry the access.
+      release(&vmlock);
+      kfreelarge(large);
+      return 0;
+    }
+    *pde = V2P(large) | PTE_P | PTE_W | PTE_U | PTE_PS;
+    release(&vmlock);
+    return 0;
+  }
+  if(*pde & PTE_PS){
+    // Large user pages are always writable.
+    release(&vmlock);
+    invlpg((void*)va);
+    return 0;
+  }
+  pte = walkpgdir(p->pgdir, (void*)va, 0);
+  if(pte == 0 || !(*pte & PTE_P)){
+    if(va >= main_thread(p)->sz || (mem = kalloc()) == 0)
+      goto bad;
+    memset(mem, 0, PGSIZE);
+    if(mappages(p->pgdir, (char*)PGROUNDDOWN(va), PGSIZE,
+                V2P(mem), PTE_W|PTE_U) < 0){
+      kfree(mem);
+      goto bad;
+    }
+    release(&vmlock);
+    return 0;
+  }
+  if(!(*pte & PTE_U))
+    goto bad;
+  if(!(err & FEC_WR) || (*pte & PTE_W)){
+    release(&vmlock);
+    invlpg((void*)va);
+    return 0;
+  }
+  if(!(*pte & PTE_COW))
+    goto bad;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefs(P2V(pa)) > 1){
+    if((mem = kalloc()) == 0)
+      goto bad;
+    memmove(mem, (char*)P2V(pa), PGSIZE);
+    *pte = V2P(mem) | flags;
+    tlbflush(p->pgdir, &va, 1);
+    kfree(P2V(pa));
+  } else {
+    *pte = pa | flags;
+    invlpg((void*)va);
+  }
+  release(&vmlock);
+  return 0;
+
+bad:
+  release(&vmlock);
+  return -1;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -90,6 +90,7 @@ int
 xem_unlock(xem_t *sema)
 {
   int timer = 0;
+  thread_t next;
   while(test_and_set(&sema->guard, 1) == 1){
     if(timer++ < SLEEPTIME){
       timer = 0;
@@ -98,8 +99,13 @@ xem_unlock(xem_t *sema)
   }
   sema->count++;
   if(!queue_empty(&sema->q)){
-    futex_wake(queue_head(&sema->q));
+    // The waiter doesn't sleep once its slot is removed,
+    // so it can be handed the CPU after the guard is free.
+    next = *queue_head(&sema->q);
     queue_remove(&sema->q);
+    sema->guard = 0;
+    futex_handoff(&next);
+    return 0;
   }
   sema->guard = 0;
   return 0;